@@ -24,8 +24,12 @@
  */
 
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -35,14 +39,123 @@
 
 #include "misc.h"
 #include "preferences.h"
+#include "probes.h"
+#include "profile.h"
 #include "audioscrobbler.h"
+#include "lfm.h"
+#include "metrics.h"
 #include "queue.h"
+#include "retry.h"
 #include "scmpc.h"
 #include "mpd.h"
+#include "trace.h"
+
+/* The protocol accepts at most 50 songs per request */
+#define AS_BATCH_SIZE 50
+
+/* A batch covers the songs from first to last in the queue. Batches are
+ * kept in queue order, and songs are only removed from the queue once all
+ * batches in front of them have been accepted as well. */
+typedef struct {
+	queue_node *first;
+	queue_node *last;
+	gint songs;
+	enum { BATCH_SENT, BATCH_DONE, BATCH_FAILED } state;
+	GString *body;
+	gchar *session;
+	lfm_response *response;
+	gint64 sent;
+} as_batch;
+
+/* The per-song parameters of a submission, in the order they are signed */
+typedef enum {
+	FIELD_ALBUM,
+	FIELD_ARTIST,
+	FIELD_DURATION,
+	FIELD_TIMESTAMP,
+	FIELD_TRACK_NUMBER,
+	FIELD_TRACK,
+	FIELD_COUNT
+} as_field_type;
+
+static const gchar *field_names[FIELD_COUNT] = {
+	"album[", "artist[", "duration[", "timestamp[", "trackNumber[", "track["
+};
+
+static GChecksum *signature;
+static gint sorted_indices[AS_BATCH_SIZE];
+
+static void as_batch_free(as_batch *batch)
+{
+	g_string_free(batch->body, TRUE);
+	g_free(batch->session);
+	lfm_response_free(batch->response);
+	g_free(batch);
+}
 
 static gchar curl_error_buffer[CURL_ERROR_SIZE];
-static void as_parse_error(char *response);
-static gint as_submit(void);
+static void as_parse_error(lfm_response *response);
+
+/* Requests are limited to a burst of 5, and one per second after that */
+#define AS_BURST 5
+#define AS_RATE 1.0
+
+/* Failures are grouped by their likely cause, and each group backs off on
+ * its own. The groups are in order of severity. Delays are in
+ * milliseconds. */
+typedef enum {
+	RETRY_NETWORK,
+	RETRY_SESSION,
+	RETRY_SERVICE,
+	RETRY_OTHER,
+	RETRY_RATE_LIMIT,
+	RETRY_CLASSES
+} as_retry_class;
+
+static backoff retry_policies[RETRY_CLASSES] = {
+	{ 1000, 300000, 0 },
+	{ 1000, 1800000, 0 },
+	{ 10000, 1800000, 0 },
+	{ 60000, 3600000, 0 },
+	{ 60000, 3600000, 0 }
+};
+
+static token_bucket requests;
+static gint64 retry_until, retry_due;
+static as_retry_class retry_class;
+static guint retry_source;
+
+/* Authentication and Now Playing go through the priority lane, submissions
+ * through the bulk lane. The bulk lane keeps a token in reserve for the
+ * other one, and doesn't start another batch while a priority request is
+ * waiting or running, so those never wait for more than the batches which
+ * are already on their way. */
+typedef enum {
+	LANE_PRIORITY,
+	LANE_BULK
+} as_lane;
+
+#define AS_PRIORITY_RESERVE 1
+
+static guint priority_running;
+static gboolean now_playing_waiting;
+static gint64 auth_started, now_playing_started;
+
+static void as_send_now_playing(void);
+
+static GQueue batches = G_QUEUE_INIT;
+static gint batches_sent;
+
+/* New songs are held back until enough of them have finished playing or
+ * the oldest one has waited long enough. A backlog of more than a full
+ * batch is drained without waiting. */
+
+/* Now Playing is only sent after the song has been current for a moment */
+static guint now_playing_source;
+static guint now_playing_skipped;
+
+static gboolean draining;
+static guint flush_source;
 
 #define API_URL "http://ws.audioscrobbler.com/2.0/"
 #define API_KEY "3ec5638071c41a864bf0c8d451566476"
@@ -53,14 +166,20 @@ gint as_connection_init(void)
 	as_conn.handle = curl_easy_init();
 	if (!as_conn.handle)
 		return -1;
+	if (http_init() < 0) {
+		curl_easy_cleanup(as_conn.handle);
+		as_conn.handle = NULL;
+		return -1;
+	}
 	as_conn.submit_url = as_conn.session_id = NULL;
-	as_conn.last_auth = 0;
 	as_conn.status = DISCONNECTED;
+	token_bucket_init(&requests, AS_BURST, AS_RATE);
 	as_conn.headers = curl_slist_append(as_conn.headers,
 			"User-Agent: scmpc/" PACKAGE_VERSION);
 
+	/* as_conn.handle only serves as a template, every request runs on a
+	 * copy of it */
 	curl_easy_setopt(as_conn.handle, CURLOPT_HTTPHEADER, as_conn.headers);
-	curl_easy_setopt(as_conn.handle, CURLOPT_WRITEFUNCTION, &buffer_write);
 	curl_easy_setopt(as_conn.handle, CURLOPT_ERRORBUFFER,curl_error_buffer);
 	curl_easy_setopt(as_conn.handle, CURLOPT_NOSIGNAL, 1L);
 	curl_easy_setopt(as_conn.handle, CURLOPT_CONNECTTIMEOUT, 5L);
@@ -70,6 +189,19 @@ gint as_connection_init(void)
 
 void as_cleanup(void)
 {
+	http_cleanup();
+	while (!g_queue_is_empty(&batches))
+		as_batch_free(g_queue_pop_head(&batches));
+	if (signature)
+		g_checksum_free(signature);
+	signature = NULL;
+	if (flush_source)
+		g_source_remove(flush_source);
+	if (retry_source)
+		g_source_remove(retry_source);
+	if (now_playing_source)
+		g_source_remove(now_playing_source);
+	flush_source = retry_source = now_playing_source = 0;
 	curl_slist_free_all(as_conn.headers);
 	curl_easy_cleanup(as_conn.handle);
 	as_conn.headers = as_conn.handle = NULL;
@@ -77,10 +209,248 @@ void as_cleanup(void)
 	g_free(as_conn.submit_url);
 }
 
+static gboolean as_retry(G_GNUC_UNUSED gpointer data)
+{
+	retry_source = 0;
+	if (as_conn.status == DISCONNECTED) {
+		as_authenticate();
+	} else {
+		if (now_playing_waiting)
+			as_send_now_playing();
+		as_check_submit();
+	}
+	return FALSE;
+}
+
+/* Wake up after delay milliseconds, or earlier if that was asked for
+ * already. A backoff always moves the wakeup to its end. */
+static void as_schedule(guint delay, gboolean force)
+{
+	gint64 due = g_get_monotonic_time() + (gint64)delay * 1000;
+
+	if (retry_source) {
+		if (!force && retry_due <= due)
+			return;
+		g_source_remove(retry_source);
+	}
+	retry_due = due;
+	retry_source = profile_timeout_add(delay, as_retry, NULL);
+}
+
+static void as_backoff(as_retry_class class)
+{
+	gint64 now = g_get_monotonic_time();
+	guint delay;
+
+	/* Requests which were already running when the first one failed
+	 * don't add to the delay, so a burst of failures counts once. A
+	 * more severe failure still gets its own backoff. */
+	if (now < retry_until && class <= retry_class)
+		return;
+
+	delay = backoff_next(&retry_policies[class]);
+	if (class == RETRY_RATE_LIMIT)
+		token_bucket_drain(&requests);
+	if (now < retry_until)
+		delay = MAX(delay, (retry_until - now + 999) / 1000);
+	retry_until = now + (gint64)delay * 1000;
+	retry_class = class;
+	g_message("Retrying in %u seconds.", (delay + 999) / 1000);
+	as_schedule(delay, TRUE);
+}
+
+static void as_success(void)
+{
+	for (gint i = 0; i < RETRY_CLASSES; i++)
+		backoff_reset(&retry_policies[i]);
+}
+
+/* Whether a request in lane may be sent now. If not, a retry is scheduled
+ * for when it may, or it is picked up when the priority lane is idle. */
+static gboolean as_may_send(as_lane lane)
+{
+	gdouble reserve = lane == LANE_BULK ? AS_PRIORITY_RESERVE : 0;
+
+	if (g_get_monotonic_time() < retry_until)
+		return FALSE;
+	if (lane == LANE_BULK && (priority_running || now_playing_waiting))
+		return FALSE;
+	if (token_bucket_take(&requests, reserve))
+		return TRUE;
+	as_schedule(token_bucket_wait(&requests, reserve), FALSE);
+	return FALSE;
+}
+
+/* Whether the request succeeded. Errors are logged and handled. */
+static gboolean as_response_ok(CURLcode result, lfm_response *response)
+{
+	if (result != CURLE_OK) {
+		g_warning("Failed to connect to Audioscrobbler: %s",
+			curl_easy_strerror(result));
+		as_backoff(RETRY_NETWORK);
+		return FALSE;
+	}
+
+	if (!lfm_response_finish(response)) {
+		g_message("Could not parse Audioscrobbler response.");
+		as_backoff(RETRY_SERVICE);
+		return FALSE;
+	}
+
+	if (!response->ok) {
+		as_parse_error(response);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* The auth token is derived from the username and the password */
+static gchar *as_auth_token(void)
+{
+	gchar *auth_token, *tmp;
+
+	if (strlen(prefs.as_password_hash) > 0) {
+		tmp = g_strdup_printf("%s%s", prefs.as_username,
+				prefs.as_password_hash);
+	} else {
+		auth_token = g_compute_checksum_for_string(G_CHECKSUM_MD5,
+				prefs.as_password, -1);
+		tmp = g_strdup_printf("%s%s", prefs.as_username, auth_token);
+		g_free(auth_token);
+	}
+	auth_token = g_compute_checksum_for_string(G_CHECKSUM_MD5, tmp, -1);
+	g_free(tmp);
+	return auth_token;
+}
+
+/* The session file identifies the credentials by a hash of the auth token */
+static gchar *as_credentials(const gchar *auth_token)
+{
+	return g_compute_checksum_for_string(G_CHECKSUM_SHA256, auth_token,
+			-1);
+}
+
+/* Session keys don't expire, so the key is kept next to the cache file and
+ * used again after a restart, as long as the credentials haven't changed.
+ * The file holds the username, a hash of the auth token and the key, one
+ * per line. It is removed when the key is rejected. */
+static gchar *as_session_path(void)
+{
+	return g_strconcat(prefs.cache_file, ".session", NULL);
+}
+
+static gboolean as_session_load(const gchar *credentials)
+{
+	gchar *path = as_session_path(), *data, **lines;
+	gboolean found = FALSE;
+
+	if (!g_file_get_contents(path, &data, NULL, NULL)) {
+		g_free(path);
+		return FALSE;
+	}
+
+	lines = g_strsplit(data, "\n", 4);
+	if (g_strv_length(lines) >= 3 &&
+			!strcmp(lines[0], prefs.as_username) &&
+			!strcmp(lines[1], credentials) && *lines[2]) {
+		g_free(as_conn.session_id);
+		as_conn.session_id = g_strdup(lines[2]);
+		found = TRUE;
+	}
+	g_strfreev(lines);
+	g_free(data);
+	g_free(path);
+	return found;
+}
+
+static void as_session_save(const gchar *credentials)
+{
+	gchar *path = as_session_path();
+	gchar *tmp_file = g_strconcat(path, ".tmp", NULL);
+	gchar *data = g_strdup_printf("%s\n%s\n%s\n", prefs.as_username,
+			credentials, as_conn.session_id);
+	gsize length = strlen(data);
+	gboolean ok;
+	gint fd;
+
+	// the key is as good as the password
+	fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		g_warning("Failed to open session file for writing: %s",
+				g_strerror(errno));
+	} else {
+		ok = fchmod(fd, 0600) == 0 &&
+			write(fd, data, length) == (gssize)length;
+		if (close(fd) < 0)
+			ok = FALSE;
+		if (!ok || rename(tmp_file, path) < 0) {
+			g_warning("Failed to write session file: %s",
+					g_strerror(errno));
+			unlink(tmp_file);
+		}
+	}
+	g_free(data);
+	g_free(tmp_file);
+	g_free(path);
+}
+
+static void as_session_forget(void)
+{
+	gchar *path = as_session_path();
+
+	if (unlink(path) < 0 && errno != ENOENT)
+		g_warning("Failed to remove session file: %s",
+				g_strerror(errno));
+	g_free(path);
+}
+
+static void as_connected(void)
+{
+	as_conn.status = CONNECTED;
+	metrics_ready(READY_AUDIOSCROBBLER);
+	if (now_playing_waiting)
+		as_send_now_playing();
+	// submit whatever has been queued in the meantime
+	as_check_submit();
+}
+
+static void as_authenticate_done(CURLcode result, gpointer data)
+{
+	lfm_response *response = data;
+	gchar *auth_token, *credentials;
+
+	priority_running--;
+	as_conn.status = DISCONNECTED;
+	metrics_observe(&metrics.auth, auth_started);
+
+	if (as_response_ok(result, response)) {
+		if (response->key) {
+			g_free(as_conn.session_id);
+			as_conn.session_id = g_strdup(response->key);
+			g_message("Connected to Audioscrobbler.");
+			auth_token = as_auth_token();
+			credentials = as_credentials(auth_token);
+			as_session_save(credentials);
+			g_free(credentials);
+			g_free(auth_token);
+			as_success();
+			as_connected();
+		} else {
+			g_message("No session key in Audioscrobbler "
+					"response.");
+			as_backoff(RETRY_SERVICE);
+			metrics.auth_errors++;
+		}
+	} else {
+		metrics.auth_errors++;
+	}
+	lfm_response_free(response);
+}
+
 void as_authenticate(void)
 {
-	gchar *auth_token, *api_sig, *auth_url, *tmp;
-	gint ret;
+	gchar *auth_token, *api_sig, *auth_url, *tmp, *credentials;
+	gboolean reused;
 
 	if (as_conn.status == BADAUTH) {
 		g_message("Refusing authentication, please check your "
@@ -89,6 +459,12 @@ void as_authenticate(void)
 		return;
 	}
 
+	if (as_conn.status == CONNECTING) {
+		g_debug("Requested authentication, but there is already "
+				"one in progress.");
+		return;
+	}
+
 	if (!strlen(prefs.as_username) || (!strlen(prefs.as_password) &&
 		!strlen(prefs.as_password_hash))) {
 		g_message("No username or password specified. "
@@ -97,24 +473,22 @@ void as_authenticate(void)
 		return;
 	}
 
-	if (difftime(time(NULL), as_conn.last_auth) < 1800) {
-		g_debug("Requested authentication, but last try "
-				"was less than 30 minutes ago.");
+	auth_token = as_auth_token();
+	credentials = as_credentials(auth_token);
+	reused = as_session_load(credentials);
+	g_free(credentials);
+	if (reused) {
+		g_message("Reusing the last Audioscrobbler session.");
+		g_free(auth_token);
+		as_connected();
 		return;
 	}
 
-	// compute auth_token
-	if (strlen(prefs.as_password_hash) > 0) {
-		tmp = g_strdup_printf("%s%s", prefs.as_username,
-				prefs.as_password_hash);
-	} else {
-		auth_token = g_compute_checksum_for_string(G_CHECKSUM_MD5,
-				prefs.as_password, -1);
-		tmp = g_strdup_printf("%s%s", prefs.as_username, auth_token);
+	if (!as_may_send(LANE_PRIORITY)) {
+		g_debug("Requested authentication, but it has to wait.");
 		g_free(auth_token);
+		return;
 	}
-	auth_token = g_compute_checksum_for_string(G_CHECKSUM_MD5, tmp, -1);
-	g_free(tmp);
 
 	// compute api_sig
 	tmp = g_strdup_printf("api_key" API_KEY "authToken%smethod"
@@ -131,53 +505,83 @@ void as_authenticate(void)
 
 	g_debug("auth_url = %s", auth_url);
 
-	curl_easy_setopt(as_conn.handle, CURLOPT_WRITEDATA, buffer);
-	curl_easy_setopt(as_conn.handle, CURLOPT_HTTPGET, 1);
-	curl_easy_setopt(as_conn.handle, CURLOPT_URL, auth_url);
-
-	ret = curl_easy_perform(as_conn.handle);
+	as_conn.status = CONNECTING;
+	priority_running++;
+	auth_started = g_get_monotonic_time();
+	http_request(as_conn.handle, auth_url, NULL, lfm_response_feed,
+			as_authenticate_done, lfm_response_new());
 	g_free(auth_url);
+}
 
-	if (ret) {
-		g_warning("Could not connect to the Audioscrobbler: %s",
-			curl_easy_strerror(ret));
-		g_free(buffer);
-		buffer = NULL;
-		return;
-	}
+static const gchar *as_ignored_reason(const lfm_song *song)
+{
+	if (song->message)
+		return song->message;
 
-	as_conn.last_auth = time(NULL);
-	if (!buffer) {
-		g_debug("Could not parse Audioscrobbler response.");
-		g_free(buffer);
-		buffer = NULL;
-		return;
+	switch (song->ignored) {
+		case 1:
+			return "Artist was ignored";
+		case 2:
+			return "Track was ignored";
+		case 3:
+			return "Timestamp was too old";
+		case 4:
+			return "Timestamp was too new";
+		case 5:
+			return "Daily scrobble limit exceeded";
+		default:
+			return "Unknown reason";
 	}
+}
+
+static void as_now_playing_done(CURLcode result, gpointer data)
+{
+	lfm_response *response = data;
+	lfm_song *song;
 
-	if (strstr(buffer, "<lfm status=\"ok\">")) {
-		char *tmp = strstr(buffer, "<key>") + 5;
-		as_conn.session_id = g_strndup(tmp, strcspn(tmp, "<"));
-		g_message("Connected to Audioscrobbler.");
-		as_conn.status = CONNECTED;
-	} else if (strstr(buffer, "<lfm status=\"failed\">")) {
-		as_parse_error(buffer);
+	priority_running--;
+	metrics_observe(&metrics.now_playing, now_playing_started);
+	PROBE1(now_playing_done, result);
+	if (as_response_ok(result, response)) {
+		as_success();
+		song = response->songs->len ? &g_array_index(response->songs,
+				lfm_song, 0) : NULL;
+		if (song && song->ignored)
+			g_message("Now Playing notification ignored: %s",
+					as_ignored_reason(song));
+		else
+			g_message("Sent Now Playing notification.");
 	} else {
-		g_debug("Could not parse Audioscrobbler response");
+		metrics.now_playing_errors++;
 	}
-	g_free(buffer);
-	buffer = NULL;
+	lfm_response_free(response);
+	// let the bulk lane continue
+	as_check_submit();
 }
 
-void as_now_playing(void)
+static void as_send_now_playing(void)
 {
 	gchar *querystring, *tmp, *sig, *artist, *album, *title, *track;
-	gint ret, length;
+	gint length;
+
+	now_playing_waiting = FALSE;
+	if (!mpd.song || !mpd.status ||
+			mpd_status_get_state(mpd.status) != MPD_STATE_PLAY) {
+		g_debug("Dropping pending Now Playing notification: "
+				"not playing anymore");
+		return;
+	}
 
-	if (as_conn.status != CONNECTED) {
+	if (as_conn.status == BADAUTH) {
 		g_message("Not sending Now Playing notification:"
 				" not connected");
 		return;
 	}
+	if (as_conn.status != CONNECTED || !as_may_send(LANE_PRIORITY)) {
+		g_debug("Now Playing notification waiting to be sent");
+		now_playing_waiting = TRUE;
+		return;
+	}
 
 	// TODO: implement this without casts
 	artist = (gchar*) mpd_song_get_tag(mpd.song, MPD_TAG_ARTIST, 0);
@@ -212,187 +616,503 @@ void as_now_playing(void)
 
 	g_debug("querystring = %s", querystring);
 
-	curl_easy_setopt(as_conn.handle, CURLOPT_WRITEDATA, buffer);
-	curl_easy_setopt(as_conn.handle, CURLOPT_POSTFIELDS, querystring);
-	curl_easy_setopt(as_conn.handle, CURLOPT_URL, API_URL);
+	priority_running++;
+	now_playing_started = g_get_monotonic_time();
+	PROBE1(now_playing_send, length);
+	http_request(as_conn.handle, API_URL, querystring, lfm_response_feed,
+			as_now_playing_done, lfm_response_new());
+}
 
-	ret = curl_easy_perform(as_conn.handle);
-	g_free(querystring);
-	if (ret) {
-		g_warning("Failed to connect to Audioscrobbler: %s",
-			curl_easy_strerror(ret));
-		g_free(buffer);
-		buffer = NULL;
+static gboolean as_now_playing_settled(G_GNUC_UNUSED gpointer data)
+{
+	now_playing_source = 0;
+
+	if (now_playing_skipped)
+		g_debug("Now Playing settled after %u skipped song%s",
+				now_playing_skipped,
+				now_playing_skipped != 1 ? "s" : "");
+	now_playing_skipped = 0;
+	as_send_now_playing();
+	return FALSE;
+}
+
+/* Send the notification once the song has been playing for a while, so
+ * skipping through a playlist doesn't send one for every song on the way */
+void as_now_playing(void)
+{
+	PROBE1(now_playing, now_playing_skipped);
+	if (now_playing_source) {
+		g_source_remove(now_playing_source);
+		now_playing_skipped++;
+		g_debug("Replacing pending Now Playing notification");
+	}
+
+	if (!prefs.as_now_playing_delay) {
+		now_playing_source = 0;
+		as_now_playing_settled(NULL);
 		return;
 	}
 
-	if (strstr(buffer, "<lfm status=\"ok\">")) {
-		g_message("Sent Now Playing notification.");
-	} else if (strstr(buffer, "<lfm status=\"failed\">")) {
-		as_parse_error(buffer);
-	} else {
-		g_debug("Unknown response from Audioscrobbler while "
-			"sending Now Playing notification.");
+	g_debug("Now Playing notification pending for %d seconds",
+			prefs.as_now_playing_delay);
+	now_playing_source = profile_timeout_add_seconds(
+			prefs.as_now_playing_delay, as_now_playing_settled,
+			NULL);
+}
+
+/* The signature needs the parameters sorted by name, which puts
+ * album[10] in front of album[2] */
+static gint as_index_cmp(gconstpointer a, gconstpointer b)
+{
+	gchar name_a[8], name_b[8];
+
+	g_snprintf(name_a, sizeof name_a, "%d]", *(const gint *)a);
+	g_snprintf(name_b, sizeof name_b, "%d]", *(const gint *)b);
+	return strcmp(name_a, name_b);
+}
+
+/* Write n in decimal to buf, which needs room for 21 characters */
+static gsize as_format_number(gchar *buf, glong n)
+{
+	gchar tmp[21];
+	gsize len = 0, i = 0;
+	gulong u = n < 0 ? -(gulong)n : (gulong)n;
+
+	do {
+		tmp[i++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (n < 0)
+		buf[len++] = '-';
+	while (i)
+		buf[len++] = tmp[--i];
+	buf[len] = '\0';
+	return len;
+}
+
+static const gchar *as_field(const queue_node *song, as_field_type field,
+		gboolean encoded, gchar *buf)
+{
+	const gchar *value;
+
+	switch (field) {
+		case FIELD_ALBUM:
+			value = encoded ? song->album_url : song->album;
+			break;
+		case FIELD_ARTIST:
+			value = encoded ? song->artist_url : song->artist;
+			break;
+		case FIELD_DURATION:
+			as_format_number(buf, song->length);
+			return buf;
+		case FIELD_TIMESTAMP:
+			as_format_number(buf, song->date);
+			return buf;
+		case FIELD_TRACK_NUMBER:
+			value = encoded ? song->track_url : song->track;
+			break;
+		default:
+			value = encoded ? song->title_url : song->title;
+			break;
 	}
+	return value ? value : "";
+}
 
-	g_free(buffer);
-	buffer = NULL;
+static void as_sign(const gchar *str, gssize length)
+{
+	g_checksum_update(signature, (const guchar *)str, length);
 }
 
-static gint build_querystring(gchar **qs, queue_node **last_song)
+/* Add the fields from first to last of all songs in signature order */
+static void as_sign_fields(queue_node **songs, gint num,
+		as_field_type first, as_field_type last)
 {
-	gchar *sig, *tmp;
-	GString *nqs;
-	GString *albums, *artists, *lengths, *timestamps, *titles;
-	GString *tracks;
-	gshort num = 0;
-	queue_node *song = queue.first;
+	gchar buf[24];
+
+	for (as_field_type field = first; field <= last; field++) {
+		for (gint i = 0; i < AS_BATCH_SIZE; i++) {
+			gint n = sorted_indices[i];
+
+			if (n >= num)
+				continue;
+			as_sign(field_names[field], -1);
+			as_sign(buf, as_format_number(buf, n));
+			as_sign("]", 1);
+			as_sign(as_field(songs[n], field, FALSE, buf), -1);
+		}
+	}
+}
 
-	nqs = g_string_new("api_key=" API_KEY "&method=track.scrobble&sk=");
-	g_string_append(nqs, as_conn.session_id);
+/* Build the request for the finished songs from song up to stop or the
+ * batch size into body. The encoded strings are precomputed in the queue, so
+ * this is only copying and hashing. */
+static gint build_querystring(queue_node *song, queue_node *stop,
+		GString *body, queue_node **last_song)
+{
+	queue_node *songs[AS_BATCH_SIZE];
+	gchar buf[24];
+	gint num = 0;
 
-	albums = g_string_new("");
-	artists = g_string_new("");
-	lengths = g_string_new("");
-	timestamps = g_string_new("");
-	titles = g_string_new("");
-	tracks = g_string_new("");
+	while (song && num < AS_BATCH_SIZE) {
+		if (song->finished_playing)
+			songs[num++] = song;
+		if (song == stop)
+			break;
+		song = queue_next(song);
+	}
+	if (!num)
+		return 0;
 
-	while (song && num < 10) {
-		gchar *album, *artist, *title, *track;
+	if (!signature) {
+		signature = g_checksum_new(G_CHECKSUM_MD5);
+		for (gint i = 0; i < AS_BATCH_SIZE; i++)
+			sorted_indices[i] = i;
+		qsort(sorted_indices, AS_BATCH_SIZE, sizeof *sorted_indices,
+				as_index_cmp);
+	}
 
-		if (!song->finished_playing) {
-			song = song->next;
-			continue;
+	g_string_truncate(body, 0);
+	g_string_append(body, "api_key=" API_KEY "&method=track.scrobble&sk=");
+	g_string_append(body, as_conn.session_id);
+	for (gint n = 0; n < num; n++) {
+		for (as_field_type field = 0; field < FIELD_COUNT; field++) {
+			g_string_append_c(body, '&');
+			g_string_append(body, field_names[field]);
+			g_string_append_len(body, buf,
+					as_format_number(buf, n));
+			g_string_append_len(body, "]=", 2);
+			g_string_append(body,
+					as_field(songs[n], field, TRUE, buf));
 		}
+	}
 
-		g_string_append_printf(albums, "album[%d]%s", num, song->album);
-		g_string_append_printf(artists, "artist[%d]%s", num,
-				song->artist);
-		g_string_append_printf(lengths, "duration[%d]%d", num,
-				song->length);
-		g_string_append_printf(timestamps, "timestamp[%d]%ld", num,
-				song->date);
-		g_string_append_printf(titles, "track[%d]%s", num, song->title);
-		g_string_append_printf(tracks, "trackNumber[%d]%s", num,
-				song->track);
-
-		album = curl_easy_escape(as_conn.handle, song->album, 0);
-		artist = curl_easy_escape(as_conn.handle, song->artist, 0);
-		title = curl_easy_escape(as_conn.handle, song->title, 0);
-		track = curl_easy_escape(as_conn.handle, song->track, 0);
-
-		g_string_append_printf(nqs, "&album[%d]=%s&artist[%d]=%s"
-				"&duration[%d]=%d&timestamp[%d]=%ld"
-				"&track[%d]=%s&trackNumber[%d]=%s",
-				num, album, num, artist, num, song->length, num,
-				song->date, num, title, num, track);
-
-		curl_free(album); curl_free(artist); curl_free(title);
-		curl_free(track);
-
-		num++;
-		song = song->next;
-	}
-
-	tmp = g_strdup_printf("%sapi_key" API_KEY "%s%smethodtrack.scrobble"
-			"sk%s%s%s%s" API_SECRET, albums->str, artists->str,
-			lengths->str, as_conn.session_id, timestamps->str,
-			tracks->str, titles->str);
-	sig = g_compute_checksum_for_string(G_CHECKSUM_MD5, tmp, -1);
-	g_free(tmp);
-	g_string_free(albums, TRUE);
-	g_string_free(artists, TRUE);
-	g_string_free(lengths, TRUE);
-	g_string_free(timestamps, TRUE);
-	g_string_free(titles, TRUE);
-	g_string_free(tracks, TRUE);
-
-	g_string_append_printf(nqs, "&api_sig=%s", sig);
-	g_free(sig);
+	g_checksum_reset(signature);
+	as_sign_fields(songs, num, FIELD_ALBUM, FIELD_ALBUM);
+	as_sign("api_key" API_KEY, -1);
+	as_sign_fields(songs, num, FIELD_ARTIST, FIELD_DURATION);
+	as_sign("methodtrack.scrobblesk", -1);
+	as_sign(as_conn.session_id, -1);
+	as_sign_fields(songs, num, FIELD_TIMESTAMP, FIELD_TRACK);
+	as_sign(API_SECRET, -1);
+
+	g_string_append(body, "&api_sig=");
+	g_string_append(body, g_checksum_get_string(signature));
 
-	*qs = g_string_free(nqs, FALSE);
-	*last_song = song;
+	for (gint n = 0; n < num; n++)
+		trace_scrobble('n', "batched", songs[n]->trace, NULL);
+
+	*last_song = songs[num - 1];
 	return num;
 }
 
-static gint as_submit(void)
+/* Remove the songs of all accepted batches at the front of the pipeline */
+static void as_acknowledge(void)
 {
-	gchar *querystring;
-	queue_node *last_added;
-	gint ret, num_songs;
+	as_batch *batch;
 
-	if (!queue.first)
-		return -1;
+	while ((batch = g_queue_peek_head(&batches)) &&
+			batch->state == BATCH_DONE) {
+		g_queue_pop_head(&batches);
+		for (queue_node *song = batch->first; song;
+				song = queue_next(song)) {
+			if (song->finished_playing)
+				trace_scrobble('e', "scrobble", song->trace,
+						"result", "submitted", NULL);
+			if (song == batch->last)
+				break;
+		}
+		queue_remove_songs(batch->first, queue_next(batch->last));
+		as_batch_free(batch);
+	}
+}
 
-	num_songs = build_querystring(&querystring, &last_added);
-	if (num_songs <= 0) {
-		g_free(querystring);
-		return -1;
+/* Split the songs from song on off into a batch of its own after batch,
+ * which is built again before it is sent. prev is the song before it. */
+static void as_batch_split(as_batch *batch, queue_node *prev,
+		queue_node *song, gint songs)
+{
+	as_batch *rest = g_new0(as_batch, 1);
+
+	rest->first = song;
+	rest->last = batch->last;
+	rest->songs = batch->songs - songs;
+	rest->state = BATCH_FAILED;
+	rest->body = g_string_sized_new(4096);
+	g_queue_insert_after(&batches, g_queue_find(&batches, batch), rest);
+
+	batch->last = prev;
+	batch->songs = songs;
+}
+
+/* Go through the results for the songs of an accepted batch. Ignored songs
+ * are dropped along with the rest of the batch, as sending them again
+ * wouldn't change anything. Only the daily limit is worth waiting for: the
+ * songs from the first one which hit it on are sent again later, the ones
+ * in front of it are done. Returns FALSE if the limit was hit. */
+static gboolean as_check_scrobbles(as_batch *batch)
+{
+	GArray *results = batch->response->songs;
+	queue_node *song = batch->first, *prev = NULL;
+	guint accepted = 0, ignored = 0;
+	gboolean limited = FALSE;
+
+	for (guint i = 0; song && i < results->len; i++) {
+		lfm_song *result = &g_array_index(results, lfm_song, i);
+
+		while (!song->finished_playing && song != batch->last) {
+			prev = song;
+			song = queue_next(song);
+		}
+
+		if (result->ignored == 5) {
+			g_message("%s", as_ignored_reason(result));
+			limited = TRUE;
+			break;
+		} else if (result->ignored) {
+			g_message("Dropping %s - %s: %s", song->artist,
+					song->title, as_ignored_reason(result));
+			trace_scrobble('n', "ignored", song->trace, "reason",
+					as_ignored_reason(result), NULL);
+			ignored++;
+		} else {
+			accepted++;
+		}
+
+		if (song == batch->last)
+			break;
+		prev = song;
+		song = queue_next(song);
 	}
 
-	g_debug("querystring = %s", querystring);
+	if (limited) {
+		if (!accepted && !ignored)
+			return FALSE;
+		as_batch_split(batch, prev, song, accepted + ignored);
+		batch->state = BATCH_DONE;
+	}
+
+	as_conn.accepted += accepted;
+	as_conn.ignored += ignored;
+	if (ignored)
+		g_message("%u song%s submitted, %u ignored.", accepted,
+				(accepted != 1 ? "s" : ""), ignored);
+	else
+		g_message("%d song%s submitted.", batch->songs,
+				(batch->songs > 1 ? "s" : ""));
+	return !limited;
+}
+
+static void as_submit_write(const gchar *chunk, gsize length, gpointer data)
+{
+	as_batch *batch = data;
+
+	lfm_response_feed(chunk, length, batch->response);
+}
+
+static void as_submit_done(CURLcode result, gpointer data)
+{
+	as_batch *batch = data;
+
+	batches_sent--;
+	metrics_observe(&metrics.submit, batch->sent);
+	PROBE3(submit_end, batch, batch->songs, result);
+
+	// only this batch has to be sent again if it fails
+	batch->state = BATCH_FAILED;
+	if (!as_response_ok(result, batch->response)) {
+		metrics.submit_errors++;
+		return;
+	}
+
+	if (!as_check_scrobbles(batch)) {
+		as_backoff(RETRY_RATE_LIMIT);
+		metrics.submit_errors++;
+		// the songs in front of the limited one may still be done
+		as_acknowledge();
+		return;
+	}
+
+	batch->state = BATCH_DONE;
+	as_success();
+	as_acknowledge();
+	// keep the pipeline full while there is a backlog
+	as_check_submit();
+}
+
+/* The first song after the last batch */
+static queue_node *as_unbatched(void)
+{
+	as_batch *batch = g_queue_peek_tail(&batches);
+
+	return batch ? queue_next(batch->last) : queue.first;
+}
+
+/* Send a failed batch again, or a new one with the songs after the last
+ * batch if batch is NULL. The request of a batch is kept for retries, it
+ * only has to be built again if the session has changed or the batch has
+ * been split. */
+static gint as_submit(as_batch *batch)
+{
+	queue_node *first, *last;
+	gboolean new_batch = !batch;
+	gint num_songs;
 
-	curl_easy_setopt(as_conn.handle, CURLOPT_WRITEDATA, buffer);
-	curl_easy_setopt(as_conn.handle, CURLOPT_POSTFIELDS, querystring);
-	curl_easy_setopt(as_conn.handle, CURLOPT_URL, API_URL);
-
-	ret = curl_easy_perform(as_conn.handle);
-	g_free(querystring);
-	if (ret != 0) {
-		g_message("Failed to connect to Audioscrobbler: %s",
-			curl_easy_strerror(ret));
-		return 1;
-	}
-
-	if (strstr(buffer, "<lfm status=\"ok\">")) {
-		g_message("%d song%s submitted.", num_songs,
-				(num_songs > 1 ? "s" : ""));
-		queue_remove_songs(queue.first, last_added);
-		queue.first = last_added;
-	} else if (strstr(buffer, "<lfm status=\"failed\">")) {
-		as_parse_error(buffer);
+	if (new_batch) {
+		if (!(first = as_unbatched()))
+			return -1;
+		batch = g_new0(as_batch, 1);
+		batch->first = first;
+		batch->body = g_string_sized_new(4096);
+	} else if (batch->session &&
+			!strcmp(batch->session, as_conn.session_id)) {
+		first = NULL;
 	} else {
-		g_message("Could not parse Audioscrobbler submit"
-				" response.");
+		first = batch->first;
+	}
+
+	if (first) {
+		num_songs = build_querystring(first, batch->last, batch->body,
+				&last);
+		if (num_songs <= 0) {
+			if (new_batch)
+				as_batch_free(batch);
+			return -1;
+		}
+		if (new_batch)
+			g_queue_push_tail(&batches, batch);
+		g_free(batch->session);
+		batch->session = g_strdup(as_conn.session_id);
+		batch->last = last;
+		batch->songs = num_songs;
 	}
 
-	g_free(buffer);
-	buffer = NULL;
+	g_debug("querystring = %s", batch->body->str);
 
+	batch->state = BATCH_SENT;
+	lfm_response_free(batch->response);
+	batch->response = lfm_response_new();
+	batches_sent++;
+	batch->sent = g_get_monotonic_time();
+	PROBE3(submit_begin, batch, batch->songs, batches_sent);
+	http_post(as_conn.handle, API_URL, batch->body->str, batch->body->len,
+			as_submit_write, as_submit_done, batch);
 	return 0;
 }
 
-static void as_parse_error(char *response)
+static void as_parse_error(lfm_response *response)
 {
-	char *tmp, *message;
-	int code;
+	if (response->message)
+		g_warning("%s", response->message);
+	else
+		g_warning("Audioscrobbler error %d", response->error);
 
-	tmp = strstr(response, "<error code=\"") + 13;
-	code = g_ascii_strtoll(tmp, NULL, 0);
-
-	switch(code) {
+	switch(response->error) {
 		case 4:
 			as_conn.status = BADAUTH;
 			break;
 		case 9:
-			as_authenticate();
+			// invalid session, authenticate again
+			as_conn.status = DISCONNECTED;
+			as_session_forget();
+			as_backoff(RETRY_SESSION);
+			break;
+		case 11:
+		case 16:
+			// service offline or temporarily unavailable
+			as_backoff(RETRY_SERVICE);
+			break;
+		case 29:
+			as_backoff(RETRY_RATE_LIMIT);
 			break;
 		default:
+			as_backoff(RETRY_OTHER);
 			break;
 	}
+}
+
+/* Count the finished songs which aren't part of a batch yet, up to max,
+ * and find out when the first of them finished */
+static gint as_pending(gint max, glong *oldest)
+{
+	queue_node *song;
+	gint count = 0;
+
+	*oldest = 0;
+	for (song = as_unbatched(); song && count < max;
+			song = queue_next(song))
+		if (song->finished_playing) {
+			/* Songs loaded from the cache must have finished by
+			 * the time they were supposed to */
+			if (!count)
+				*oldest = song->finished ? song->finished :
+					song->date + (glong)song->length;
+			count++;
+		}
+	return count;
+}
+
+static gboolean as_flush(G_GNUC_UNUSED gpointer data)
+{
+	flush_source = 0;
+	as_check_submit();
+	return FALSE;
+}
+
+static gboolean as_should_flush(void)
+{
+	glong oldest;
+	gint pending = as_pending(AS_BATCH_SIZE, &oldest);
+	gdouble waited;
+
+	if (!pending) {
+		draining = FALSE;
+		return FALSE;
+	}
 
-	tmp = strstr(tmp, "\">") + 2;
-	message = g_strndup(tmp, strcspn(tmp, "<"));
-	g_warning("%s", message);
-	g_free(message);
+	if (pending >= AS_BATCH_SIZE && !draining) {
+		g_debug("Draining the backlog of %d songs.",
+				queue.length + queue_on_disk());
+		draining = TRUE;
+	}
+	if (draining || pending >= prefs.as_batch_songs)
+		return TRUE;
+
+	// batch_delay counts from when the oldest of the songs finished
+	waited = MAX(difftime(time(NULL), oldest), 0);
+	if (waited >= prefs.as_batch_delay)
+		return TRUE;
+
+	if (!flush_source)
+		flush_source = profile_timeout_add_seconds(
+				prefs.as_batch_delay - waited, as_flush, NULL);
+	return FALSE;
 }
 
 void as_check_submit(void)
 {
-	if (queue.length > 0 && as_conn.status == CONNECTED &&
-			difftime(time(NULL), as_conn.last_fail) >= 600) {
-		if (as_submit() == 1)
-		as_conn.last_fail = time(NULL);
+	GList *link;
+
+	if (as_conn.status != CONNECTED)
+		return;
+
+	// failed batches are in front of the new ones, so they go first
+	for (link = batches.head; link && batches_sent < prefs.as_batches;
+			link = link->next) {
+		as_batch *batch = link->data;
+
+		if (batch->state != BATCH_FAILED)
+			continue;
+		if (!as_may_send(LANE_BULK))
+			return;
+		as_submit(batch);
+	}
+
+	while (batches_sent < prefs.as_batches && as_should_flush()) {
+		if (!as_may_send(LANE_BULK) || as_submit(NULL) < 0)
+			break;
+		if (flush_source) {
+			g_source_remove(flush_source);
+			flush_source = 0;
+		}
 	}
 }
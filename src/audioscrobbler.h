@@ -24,26 +24,22 @@
  */
 
 
-/* curl/curl.h requires sys/select.h but doesn't include it on FreeBSD */
-#include <sys/select.h>
-#include <curl/curl.h>
 #include <glib.h>
 
+#include "http.h"
 #include "misc.h"
 
 struct {
 	gchar *session_id;
 	gchar *submit_url;
 	gchar password[33];
-	time_t last_auth;
-	time_t last_fail;
 	connection_status status;
+	guint accepted;
+	guint ignored;
 	CURL *handle;
 	struct curl_slist *headers;
 } as_conn;
 
-gchar *buffer;
-
 gint as_connection_init(void);
 void as_authenticate(void);
 void as_check_submit(void);
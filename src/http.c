@@ -0,0 +1,341 @@
+/**
+ * http.c: Asynchronous HTTP requests.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#include <string.h>
+
+#include "misc.h"
+#include "http.h"
+#include "profile.h"
+#include "trace.h"
+
+typedef struct {
+	CURL *handle;
+	gchar *body;
+	http_write_func write;
+	http_callback callback;
+	gpointer data;
+	gchar error[CURL_ERROR_SIZE];
+	gint64 started;
+} http_transfer;
+
+/* Resolved addresses are kept this long, in seconds */
+#define HTTP_DNS_TTL 600
+/* Idle connections kept open for the next request */
+#define HTTP_MAX_CONNECTS 4
+
+/* The multi handle keeps connections open between requests. The share
+ * handle adds the DNS cache and TLS sessions, so a new connection to the
+ * same host needs neither a lookup nor a full handshake. */
+static CURLM *multi;
+static CURLSH *share;
+static GList *transfers;
+static guint timer_source;
+static gint running;
+
+static void http_transfer_free(http_transfer *transfer);
+static void http_check_done(void);
+
+static gsize http_write(void *chunk, gsize size, gsize nmemb, void *data)
+{
+	http_transfer *transfer = data;
+
+	transfer->write(chunk, size * nmemb, transfer->data);
+	return size * nmemb;
+}
+
+static gboolean http_socket_event(GIOChannel *source, GIOCondition condition,
+		G_GNUC_UNUSED gpointer data)
+{
+	gint action = 0;
+
+	if (condition & G_IO_IN)
+		action |= CURL_CSELECT_IN;
+	if (condition & G_IO_OUT)
+		action |= CURL_CSELECT_OUT;
+	if (condition & (G_IO_ERR | G_IO_HUP))
+		action |= CURL_CSELECT_ERR;
+
+	curl_multi_socket_action(multi, g_io_channel_unix_get_fd(source),
+			action, &running);
+	http_check_done();
+	return TRUE;
+}
+
+static gint http_socket_cb(G_GNUC_UNUSED CURL *handle, curl_socket_t s,
+		gint what, G_GNUC_UNUSED void *userp, void *socketp)
+{
+	guint *source = socketp;
+	GIOCondition condition = G_IO_ERR | G_IO_HUP;
+	GIOChannel *channel;
+
+	if (source)
+		g_source_remove(*source);
+
+	if (what == CURL_POLL_REMOVE) {
+		g_free(source);
+		return 0;
+	}
+
+	if (!source) {
+		source = g_malloc(sizeof (guint));
+		curl_multi_assign(multi, s, source);
+	}
+
+	if (what & CURL_POLL_IN)
+		condition |= G_IO_IN;
+	if (what & CURL_POLL_OUT)
+		condition |= G_IO_OUT;
+
+	channel = g_io_channel_unix_new(s);
+	*source = profile_io_add_watch(channel, condition, http_socket_event,
+			NULL);
+	g_io_channel_unref(channel);
+	return 0;
+}
+
+static gboolean http_timer_event(G_GNUC_UNUSED gpointer data)
+{
+	timer_source = 0;
+	curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	http_check_done();
+	return FALSE;
+}
+
+static gint http_timer_cb(G_GNUC_UNUSED CURLM *m, glong timeout_ms,
+		G_GNUC_UNUSED void *userp)
+{
+	if (timer_source) {
+		g_source_remove(timer_source);
+		timer_source = 0;
+	}
+
+	if (timeout_ms >= 0)
+		timer_source = profile_timeout_add(timeout_ms, http_timer_event,
+				NULL);
+	return 0;
+}
+
+static gdouble http_elapsed(CURL *handle, CURLINFO info, gdouble since)
+{
+	gdouble time = 0;
+
+	curl_easy_getinfo(handle, info, &time);
+	return time > since ? (time - since) * 1000 : 0;
+}
+
+static void http_account(http_transfer *transfer, CURLcode result)
+{
+	CURL *handle = transfer->handle;
+	gdouble dns, connect, tls, ttfb, total, lookup = 0, connected = 0;
+	gdouble handshake = 0;
+	glong connects = 0;
+	gchar *url = NULL, *path;
+
+	curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME, &lookup);
+	curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME, &connected);
+	curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME, &handshake);
+	curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+
+	/* curl reports the time from the start of the request until the end
+	 * of each phase, the phases themselves are the differences */
+	dns = http_elapsed(handle, CURLINFO_NAMELOOKUP_TIME, 0);
+	connect = http_elapsed(handle, CURLINFO_CONNECT_TIME, lookup);
+	tls = handshake ? http_elapsed(handle, CURLINFO_APPCONNECT_TIME,
+			connected) : 0;
+	ttfb = http_elapsed(handle, CURLINFO_STARTTRANSFER_TIME,
+			MAX(handshake, connected));
+	total = http_elapsed(handle, CURLINFO_TOTAL_TIME, 0);
+
+	g_debug("HTTP request took %.0f ms: DNS %.0f ms, connect %.0f ms, "
+			"TLS %.0f ms, first byte %.0f ms (%s connection)",
+			total, dns, connect, tls, ttfb,
+			connects ? "new" : "reused");
+
+	http_stats.requests++;
+	http_stats.connects += connects;
+	http_stats.dns += dns;
+	http_stats.connect += connect;
+	http_stats.tls += tls;
+	http_stats.ttfb += ttfb;
+	http_stats.total += total;
+
+	// leave out the query, it may contain credentials
+	curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url);
+	path = url ? g_strndup(url, strcspn(url, "?")) : g_strdup("");
+	trace_span("http", "request", transfer->started, "url", path,
+			"result", curl_easy_strerror(result),
+			"connection", connects ? "new" : "reused", NULL);
+	g_free(path);
+	if (dns)
+		trace_phase("http", "dns", transfer->started, 0, dns * 1000,
+				NULL);
+	if (connect)
+		trace_phase("http", "connect", transfer->started,
+				lookup * G_USEC_PER_SEC, connect * 1000, NULL);
+	if (tls)
+		trace_phase("http", "tls", transfer->started,
+				connected * G_USEC_PER_SEC, tls * 1000, NULL);
+	trace_phase("http", "wait", transfer->started,
+			MAX(handshake, connected) * G_USEC_PER_SEC,
+			ttfb * 1000, NULL);
+}
+
+static void http_check_done(void)
+{
+	CURLMsg *msg;
+	gint pending;
+
+	while ((msg = curl_multi_info_read(multi, &pending))) {
+		http_transfer *transfer;
+		CURLcode result;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+				(gchar **)&transfer);
+		/* msg is invalid once the handle has been removed */
+		result = msg->data.result;
+		curl_multi_remove_handle(multi, transfer->handle);
+		transfers = g_list_remove(transfers, transfer);
+
+		if (result != CURLE_OK)
+			g_debug("HTTP request failed: %s", transfer->error);
+		http_account(transfer, result);
+
+		transfer->callback(result, transfer->data);
+		http_transfer_free(transfer);
+	}
+}
+
+gint http_init(void)
+{
+	multi = curl_multi_init();
+	if (!multi)
+		return -1;
+
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, http_socket_cb);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, http_timer_cb);
+	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS,
+			(glong)HTTP_MAX_CONNECTS);
+
+	/* Everything runs in the main loop, so the share handle doesn't need
+	 * any locking */
+	share = curl_share_init();
+	if (share) {
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(share, CURLSHOPT_SHARE,
+				CURL_LOCK_DATA_SSL_SESSION);
+	}
+	return 0;
+}
+
+void http_cleanup(void)
+{
+	/* Requests still in flight are dropped without calling back */
+	while (transfers) {
+		http_transfer *transfer = transfers->data;
+		curl_multi_remove_handle(multi, transfer->handle);
+		transfers = g_list_delete_link(transfers, transfers);
+		http_transfer_free(transfer);
+	}
+
+	if (timer_source) {
+		g_source_remove(timer_source);
+		timer_source = 0;
+	}
+	curl_multi_cleanup(multi);
+	multi = NULL;
+	if (share)
+		curl_share_cleanup(share);
+	share = NULL;
+}
+
+static void http_start(CURL *template, const gchar *url, gchar *owned,
+		const gchar *body, gsize length, http_write_func write,
+		http_callback callback, gpointer data)
+{
+	http_transfer *transfer;
+	CURLMcode ret;
+
+	transfer = g_malloc0(sizeof (http_transfer));
+	transfer->handle = curl_easy_duphandle(template);
+	transfer->body = owned;
+	transfer->write = write;
+	transfer->callback = callback;
+	transfer->data = data;
+	transfer->started = g_get_monotonic_time();
+
+	curl_easy_setopt(transfer->handle, CURLOPT_PRIVATE, transfer);
+	curl_easy_setopt(transfer->handle, CURLOPT_WRITEFUNCTION, http_write);
+	curl_easy_setopt(transfer->handle, CURLOPT_WRITEDATA, transfer);
+	curl_easy_setopt(transfer->handle, CURLOPT_ERRORBUFFER,
+			transfer->error);
+	curl_easy_setopt(transfer->handle, CURLOPT_URL, url);
+	curl_easy_setopt(transfer->handle, CURLOPT_DNS_CACHE_TIMEOUT,
+			(glong)HTTP_DNS_TTL);
+	curl_easy_setopt(transfer->handle, CURLOPT_TCP_KEEPALIVE, 1L);
+	if (share)
+		curl_easy_setopt(transfer->handle, CURLOPT_SHARE, share);
+	if (body) {
+		curl_easy_setopt(transfer->handle, CURLOPT_POSTFIELDSIZE,
+				(glong)length);
+		curl_easy_setopt(transfer->handle, CURLOPT_POSTFIELDS, body);
+	} else {
+		curl_easy_setopt(transfer->handle, CURLOPT_HTTPGET, 1L);
+	}
+
+	ret = curl_multi_add_handle(multi, transfer->handle);
+	if (ret != CURLM_OK) {
+		g_warning("Could not start HTTP request: %s",
+				curl_multi_strerror(ret));
+		callback(CURLE_FAILED_INIT, data);
+		http_transfer_free(transfer);
+		return;
+	}
+	transfers = g_list_prepend(transfers, transfer);
+}
+
+void http_request(CURL *template, const gchar *url, gchar *body,
+		http_write_func write, http_callback callback, gpointer data)
+{
+	http_start(template, url, body, body, body ? strlen(body) : 0,
+			write, callback, data);
+}
+
+void http_post(CURL *template, const gchar *url, const gchar *body,
+		gsize length, http_write_func write, http_callback callback,
+		gpointer data)
+{
+	http_start(template, url, NULL, body, length, write, callback, data);
+}
+
+static void http_transfer_free(http_transfer *transfer)
+{
+	curl_easy_cleanup(transfer->handle);
+	g_free(transfer->body);
+	g_free(transfer);
+}
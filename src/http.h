@@ -0,0 +1,66 @@
+/**
+ * http.h: Asynchronous HTTP requests.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#ifndef HAVE_HTTP_H
+#define HAVE_HTTP_H
+
+/* curl/curl.h requires sys/select.h but doesn't include it on FreeBSD */
+#include <sys/select.h>
+#include <curl/curl.h>
+#include <glib.h>
+
+/* Called with every chunk of the response as it arrives */
+typedef void (*http_write_func)(const gchar *chunk, gsize length,
+		gpointer data);
+/* Called from the main loop once a request has finished */
+typedef void (*http_callback)(CURLcode result, gpointer data);
+
+/* Totals over all finished requests, times are in milliseconds. connects
+ * counts the requests which needed a new connection. */
+struct {
+	guint requests;
+	guint connects;
+	gdouble dns;
+	gdouble connect;
+	gdouble tls;
+	gdouble ttfb;
+	gdouble total;
+} http_stats;
+
+gint http_init(void);
+void http_cleanup(void);
+
+/* Start a request on a copy of template. If body is NULL a GET request is
+ * sent, otherwise body is POSTed and freed when the request is done. */
+void http_request(CURL *template, const gchar *url, gchar *body,
+		http_write_func write, http_callback callback, gpointer data);
+/* POST length bytes of body, which is only borrowed and has to stay valid
+ * until callback has been called */
+void http_post(CURL *template, const gchar *url, const gchar *body,
+		gsize length, http_write_func write, http_callback callback,
+		gpointer data);
+
+#endif // HAVE_HTTP_H
@@ -0,0 +1,449 @@
+/**
+ * journal.c: Append-only journal of queue changes.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "misc.h"
+#include "journal.h"
+#include "preferences.h"
+
+/* The journal records every change to the queue since the cache file was
+ * last written. It starts with a checkpoint record naming the generation of
+ * that cache file, so a journal which is older than the cache is ignored.
+ * While a new cache file is written, a checkpoint with its generation marks
+ * where the changes it doesn't contain start, so the journal stays valid
+ * with either file until it is cut down to the part after the mark.
+ *
+ * Every record is a header followed by a body of header.size bytes, the
+ * first of which is the record type. The body is protected by a CRC32 so a
+ * record torn by a crash can be detected and cut off. */
+enum {
+	JOURNAL_CHECKPOINT = 'C',
+	JOURNAL_ADD = 'A',
+	JOURNAL_REMOVE = 'R'
+};
+
+typedef struct {
+	guint32 size;
+	guint32 crc;
+} journal_header;
+
+typedef struct {
+	const gchar *data;
+	gsize left;
+} journal_reader;
+
+static gboolean journal_open(gsize length);
+
+static GString *journal_record_new(gchar type)
+{
+	GString *record = g_string_sized_new(128);
+
+	g_string_set_size(record, sizeof (journal_header));
+	g_string_append_c(record, type);
+	return record;
+}
+
+static void journal_put_int(GString *record, const void *value, gsize size)
+{
+	g_string_append_len(record, value, size);
+}
+
+static void journal_put_string(GString *record, const gchar *str)
+{
+	guint32 len = str ? strlen(str) : 0;
+
+	journal_put_int(record, &len, sizeof len);
+	g_string_append_len(record, str, len);
+}
+
+static gboolean journal_get_int(journal_reader *reader, void *value,
+		gsize size)
+{
+	if (reader->left < size)
+		return FALSE;
+	memcpy(value, reader->data, size);
+	reader->data += size;
+	reader->left -= size;
+	return TRUE;
+}
+
+static gchar *journal_get_string(journal_reader *reader)
+{
+	guint32 len;
+	gchar *str;
+
+	if (!journal_get_int(reader, &len, sizeof len) || reader->left < len)
+		return NULL;
+	str = g_strndup(reader->data, len);
+	reader->data += len;
+	reader->left -= len;
+	return str;
+}
+
+static GString *journal_checkpoint_new(guint64 generation)
+{
+	GString *record = journal_record_new(JOURNAL_CHECKPOINT);
+
+	journal_put_int(record, &generation, sizeof generation);
+	return record;
+}
+
+static void journal_seal(GString *record)
+{
+	journal_header *header = (journal_header *)record->str;
+
+	header->size = record->len - sizeof *header;
+	header->crc = crc32_checksum(record->str + sizeof *header,
+			header->size);
+}
+
+static gboolean journal_write_all(gint fd, const gchar *data, gsize len)
+{
+	gsize written = 0;
+	gssize ret;
+
+	while (written < len) {
+		ret = write(fd, data + written, len - written);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return FALSE;
+		written += ret;
+	}
+	return TRUE;
+}
+
+static gboolean journal_write(GString *record)
+{
+	off_t offset;
+
+	if (!journal.path || journal.fd < 0) {
+		g_string_free(record, TRUE);
+		return FALSE;
+	}
+
+	journal_seal(record);
+	offset = lseek(journal.fd, 0, SEEK_END);
+	if (!journal_write_all(journal.fd, record->str, record->len)) {
+		g_warning("Failed to write to journal: %s",
+				g_strerror(errno));
+		/* Don't leave a torn record in front of the next one,
+		 * recovery would stop there */
+		if (ftruncate(journal.fd, offset) < 0)
+			g_warning("Failed to truncate journal: %s",
+					g_strerror(errno));
+		g_string_free(record, TRUE);
+		return FALSE;
+	}
+	g_string_free(record, TRUE);
+
+	if (fdatasync(journal.fd) < 0)
+		g_warning("Failed to sync journal: %s", g_strerror(errno));
+	return TRUE;
+}
+
+static gboolean journal_get_checkpoint(const gchar *body, gsize size,
+		guint64 *generation)
+{
+	journal_reader reader = { body + 1, size - 1 };
+
+	return body[0] == JOURNAL_CHECKPOINT && size == 1 + sizeof *generation
+		&& journal_get_int(&reader, generation, sizeof *generation);
+}
+
+static gboolean journal_apply(const gchar *body, gsize size,
+		journal_add_func add, journal_remove_func remove)
+{
+	journal_reader reader = { body + 1, size - 1 };
+	gchar *artist, *title, *album, *track;
+	guint32 length, count;
+	gint64 date;
+	gboolean ret;
+
+	switch (body[0]) {
+		case JOURNAL_ADD:
+			if (!journal_get_int(&reader, &date, sizeof date) ||
+				!journal_get_int(&reader, &length,
+					sizeof length))
+				return FALSE;
+			artist = journal_get_string(&reader);
+			title = journal_get_string(&reader);
+			album = journal_get_string(&reader);
+			track = journal_get_string(&reader);
+			ret = artist && title && album && track;
+			if (ret)
+				add(artist, title, album, length, track, date);
+			g_free(artist); g_free(title); g_free(album);
+			g_free(track);
+			return ret;
+		case JOURNAL_REMOVE:
+			if (!journal_get_int(&reader, &count, sizeof count))
+				return FALSE;
+			remove(count);
+			journal.dead += count + 1;
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+gboolean journal_replay(guint64 generation, journal_add_func add,
+		journal_remove_func remove)
+{
+	gchar *contents;
+	gsize length, pos = 0;
+	GError *error = NULL;
+	journal_header header;
+	guint64 checkpoint;
+	gboolean active = FALSE, checked = FALSE;
+	guint skipped = 0;
+
+	g_free(journal.path);
+	journal.path = g_strconcat(prefs.cache_file, ".journal", NULL);
+	journal.fd = -1;
+	journal.mark = generation;
+	journal.mark_offset = 0;
+
+	if (!g_file_get_contents(journal.path, &contents, &length, &error)) {
+		if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_message("Failed to read journal: %s",
+					error->message);
+		g_error_free(error);
+		return journal_reset(generation);
+	}
+
+	journal.generation = generation;
+	journal.records = journal.dead = 0;
+
+	/* Changes are applied from the checkpoint of the cache file that has
+	 * just been loaded on, everything in front of it is in the cache
+	 * already. A journal without that checkpoint is stale. */
+	while (pos + sizeof header < length) {
+		const gchar *body = contents + pos + sizeof header;
+
+		memcpy(&header, contents + pos, sizeof header);
+		if (!header.size || header.size > length - pos - sizeof header)
+			break;
+		if (crc32_checksum(body, header.size) != header.crc)
+			break;
+		if (journal_get_checkpoint(body, header.size, &checkpoint)) {
+			if (checkpoint == generation)
+				active = TRUE;
+			journal.mark = MAX(journal.mark, checkpoint);
+		} else if (!checked) {
+			break;
+		} else if (!active) {
+			skipped++;
+		} else if (journal_apply(body, header.size, add, remove)) {
+			journal.records++;
+		} else {
+			break;
+		}
+		checked = TRUE;
+		pos += sizeof header + header.size;
+	}
+
+	if (!active) {
+		g_debug("Ignoring stale journal.");
+		g_free(contents);
+		return journal_reset(generation);
+	}
+
+	if (pos < length)
+		g_message("Discarding %lu bytes of incomplete journal.",
+				(gulong)(length - pos));
+	g_debug("Replayed %u journal records.", journal.records);
+	journal.records += skipped;
+	journal.dead += skipped;
+	g_free(contents);
+
+	return journal_open(pos);
+}
+
+static gboolean journal_open(gsize length)
+{
+	journal.fd = open(journal.path, O_WRONLY | O_CREAT, 0644);
+	if (journal.fd < 0) {
+		g_warning("Failed to open journal for writing: %s",
+				g_strerror(errno));
+		return FALSE;
+	}
+
+	if (ftruncate(journal.fd, length) < 0) {
+		g_warning("Failed to truncate journal: %s", g_strerror(errno));
+		close(journal.fd);
+		journal.fd = -1;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+gboolean journal_reset(guint64 generation)
+{
+	GString *record;
+
+	if (journal.fd >= 0)
+		close(journal.fd);
+	if (!journal_open(0))
+		return FALSE;
+
+	journal.generation = generation;
+	journal.records = journal.dead = 0;
+	journal.mark = MAX(journal.mark, generation);
+	journal.mark_offset = 0;
+
+	record = journal_checkpoint_new(generation);
+	return journal_write(record);
+}
+
+/* For a journal whose cache file couldn't be read: it is moved aside and a
+ * new one started. If that fails it is left alone, and nothing is written
+ * to it. */
+gboolean journal_set_aside(void)
+{
+	g_free(journal.path);
+	journal.path = g_strconcat(prefs.cache_file, ".journal", NULL);
+	journal.fd = -1;
+	journal.mark = journal.mark_offset = 0;
+
+	if (!file_set_aside(journal.path)) {
+		g_free(journal.path);
+		journal.path = NULL;
+		return FALSE;
+	}
+	return journal_reset(0);
+}
+
+/* Marks the start of the changes a cache file about to be written won't
+ * contain, and returns the generation it has to be written with */
+guint64 journal_mark(void)
+{
+	off_t offset;
+
+	journal.mark++;
+	journal.mark_offset = 0;
+	if (!journal_write(journal_checkpoint_new(journal.mark)))
+		return journal.mark;
+
+	offset = lseek(journal.fd, 0, SEEK_END);
+	if (offset > 0) {
+		journal.mark_offset = offset;
+		journal.mark_records = journal.records;
+		journal.mark_dead = journal.dead;
+	}
+	return journal.mark;
+}
+
+/* Called once the cache file of the given generation is on disk: drops
+ * everything in front of its mark. If that fails the journal is still
+ * valid, it just stays as long as it is. */
+gboolean journal_rebase(guint64 generation)
+{
+	gchar *contents, *tmp_path;
+	gsize length;
+	GString *record;
+	gint fd;
+
+	if (!journal.mark_offset || generation != journal.mark)
+		return journal_reset(generation);
+
+	journal.generation = generation;
+	if (!g_file_get_contents(journal.path, &contents, &length, NULL) ||
+			length < (gsize)journal.mark_offset)
+		return journal_reset(generation);
+
+	tmp_path = g_strconcat(journal.path, ".tmp", NULL);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	record = journal_checkpoint_new(generation);
+	journal_seal(record);
+	if (fd < 0 || !journal_write_all(fd, record->str, record->len) ||
+			!journal_write_all(fd, contents + journal.mark_offset,
+				length - journal.mark_offset) ||
+			fdatasync(fd) < 0 ||
+			rename(tmp_path, journal.path) < 0) {
+		g_message("Failed to shorten journal: %s", g_strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		unlink(tmp_path);
+		g_string_free(record, TRUE);
+		g_free(tmp_path);
+		g_free(contents);
+		return FALSE;
+	}
+	g_string_free(record, TRUE);
+	g_free(tmp_path);
+	g_free(contents);
+
+	close(journal.fd);
+	journal.fd = fd;
+	journal.records -= journal.mark_records;
+	journal.dead -= journal.mark_dead;
+	journal.mark_offset = 0;
+	return TRUE;
+}
+
+void journal_close(void)
+{
+	if (journal.path && journal.fd >= 0)
+		close(journal.fd);
+	journal.fd = -1;
+	g_free(journal.path);
+	journal.path = NULL;
+}
+
+void journal_add(const gchar *artist, const gchar *title, const gchar *album,
+		guint length, const gchar *track, glong date)
+{
+	GString *record = journal_record_new(JOURNAL_ADD);
+	gint64 date64 = date;
+	guint32 length32 = length;
+
+	journal_put_int(record, &date64, sizeof date64);
+	journal_put_int(record, &length32, sizeof length32);
+	journal_put_string(record, artist);
+	journal_put_string(record, title);
+	journal_put_string(record, album);
+	journal_put_string(record, track);
+	if (journal_write(record))
+		journal.records++;
+}
+
+void journal_remove(guint count)
+{
+	GString *record = journal_record_new(JOURNAL_REMOVE);
+	guint32 count32 = count;
+
+	journal_put_int(record, &count32, sizeof count32);
+	if (journal_write(record)) {
+		journal.records++;
+		journal.dead += count + 1;
+	}
+}
@@ -0,0 +1,68 @@
+/**
+ * journal.h: Append-only journal of queue changes.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#ifndef HAVE_JOURNAL_H
+#define HAVE_JOURNAL_H
+
+#include <sys/types.h>
+#include <glib.h>
+
+/* Compact the journal once this many of its records are obsolete */
+#define JOURNAL_COMPACT_THRESHOLD 100
+/* or once it has grown this long, or longer than the queue itself */
+#define JOURNAL_MAX_RECORDS 1000
+
+typedef void (*journal_add_func)(const gchar *artist, const gchar *title,
+		const gchar *album, guint length, const gchar *track,
+		glong date);
+typedef void (*journal_remove_func)(guint count);
+
+struct {
+	gint fd;
+	gchar *path;
+	guint64 generation;
+	guint records;
+	guint dead;
+	/* The checkpoint of the cache file being written */
+	guint64 mark;
+	off_t mark_offset;
+	guint mark_records;
+	guint mark_dead;
+} journal;
+
+gboolean journal_replay(guint64 generation, journal_add_func add,
+		journal_remove_func remove);
+gboolean journal_reset(guint64 generation);
+gboolean journal_set_aside(void);
+guint64 journal_mark(void);
+gboolean journal_rebase(guint64 generation);
+void journal_close(void);
+
+void journal_add(const gchar *artist, const gchar *title, const gchar *album,
+		guint length, const gchar *track, glong date);
+void journal_remove(guint count);
+
+#endif // HAVE_JOURNAL_H
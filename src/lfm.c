@@ -0,0 +1,185 @@
+/**
+ * lfm.c: Parser for Last.fm web service responses.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lfm.h"
+#include "misc.h"
+
+/* Responses are parsed as they arrive, so they never have to be held in
+ * memory as a whole. Only the elements scmpc cares about are looked at:
+ *
+ * <lfm status="ok|failed">
+ *   <error code="N">message</error>
+ *   <session><key>...</key></session>
+ *   <scrobbles><scrobble>...<ignoredMessage code="N">message</...>
+ *   <nowplaying>...<ignoredMessage code="N">message</...>
+ */
+
+static const gchar *lfm_attribute(const gchar **names, const gchar **values,
+		const gchar *name)
+{
+	for (; *names; names++, values++)
+		if (!strcmp(*names, name))
+			return *values;
+	return NULL;
+}
+
+static void lfm_start_element(G_GNUC_UNUSED GMarkupParseContext *context,
+		const gchar *element, const gchar **names,
+		const gchar **values, gpointer data,
+		G_GNUC_UNUSED GError **error)
+{
+	lfm_response *response = data;
+	const gchar *value;
+
+	g_string_truncate(response->text, 0);
+
+	if (!strcmp(element, "lfm")) {
+		value = lfm_attribute(names, values, "status");
+		response->valid = value != NULL;
+		response->ok = value && !strcmp(value, "ok");
+	} else if (!strcmp(element, "error")) {
+		value = lfm_attribute(names, values, "code");
+		response->error = value ? atoi(value) : -1;
+	} else if (!strcmp(element, "scrobble") ||
+			!strcmp(element, "nowplaying")) {
+		lfm_song song = { 0, NULL };
+
+		g_array_append_val(response->songs, song);
+	} else if (!strcmp(element, "ignoredMessage") &&
+			response->songs->len) {
+		value = lfm_attribute(names, values, "code");
+		g_array_index(response->songs, lfm_song,
+				response->songs->len - 1).ignored =
+			value ? atoi(value) : 0;
+	}
+}
+
+static void lfm_end_element(G_GNUC_UNUSED GMarkupParseContext *context,
+		const gchar *element, gpointer data,
+		G_GNUC_UNUSED GError **error)
+{
+	lfm_response *response = data;
+
+	if (!strcmp(element, "error")) {
+		g_free(response->message);
+		response->message = g_strdup(response->text->str);
+	} else if (!strcmp(element, "key")) {
+		g_free(response->key);
+		response->key = g_strdup(response->text->str);
+	} else if (!strcmp(element, "ignoredMessage") &&
+			response->songs->len) {
+		lfm_song *song = &g_array_index(response->songs, lfm_song,
+				response->songs->len - 1);
+
+		if (song->ignored && response->text->len)
+			song->message = g_strdup(response->text->str);
+	}
+	g_string_truncate(response->text, 0);
+}
+
+static void lfm_text(G_GNUC_UNUSED GMarkupParseContext *context,
+		const gchar *text, gsize length, gpointer data,
+		G_GNUC_UNUSED GError **error)
+{
+	lfm_response *response = data;
+
+	g_string_append_len(response->text, text, length);
+}
+
+static const GMarkupParser lfm_parser = {
+	lfm_start_element,
+	lfm_end_element,
+	lfm_text,
+	NULL,
+	NULL
+};
+
+lfm_response *lfm_response_new(void)
+{
+	lfm_response *response = g_malloc0(sizeof (lfm_response));
+
+	response->context = g_markup_parse_context_new(&lfm_parser, 0,
+			response, NULL);
+	response->songs = g_array_new(FALSE, FALSE, sizeof (lfm_song));
+	response->text = g_string_new("");
+	return response;
+}
+
+void lfm_response_free(lfm_response *response)
+{
+	if (!response)
+		return;
+	for (guint i = 0; i < response->songs->len; i++)
+		g_free(g_array_index(response->songs, lfm_song, i).message);
+	g_array_free(response->songs, TRUE);
+	g_string_free(response->text, TRUE);
+	if (response->context)
+		g_markup_parse_context_free(response->context);
+	g_free(response->message);
+	g_free(response->key);
+	g_free(response);
+}
+
+/* Feed the next chunk of the response. Anything after a parse error is
+ * ignored, the response is invalid then. */
+void lfm_response_feed(const gchar *data, gsize length, gpointer user_data)
+{
+	lfm_response *response = user_data;
+	GError *error = NULL;
+
+	if (!response->context)
+		return;
+	if (!g_markup_parse_context_parse(response->context, data, length,
+				&error)) {
+		g_debug("Could not parse Audioscrobbler response: %s",
+				error->message);
+		g_error_free(error);
+		g_markup_parse_context_free(response->context);
+		response->context = NULL;
+		response->valid = FALSE;
+	}
+}
+
+/* Returns whether the response was a complete, well-formed reply */
+gboolean lfm_response_finish(lfm_response *response)
+{
+	GError *error = NULL;
+
+	if (!response->context)
+		return FALSE;
+	if (!g_markup_parse_context_end_parse(response->context, &error)) {
+		g_debug("Could not parse Audioscrobbler response: %s",
+				error->message);
+		g_error_free(error);
+		response->valid = FALSE;
+	}
+	g_markup_parse_context_free(response->context);
+	response->context = NULL;
+	return response->valid;
+}
@@ -0,0 +1,55 @@
+/**
+ * lfm.h: Parser for Last.fm web service responses.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#ifndef HAVE_LFM_H
+#define HAVE_LFM_H
+
+#include <glib.h>
+
+/* The result of one song in a scrobble or now playing response. ignored is
+ * the code of the ignoredMessage, 0 if the song was accepted. */
+typedef struct {
+	gint ignored;
+	gchar *message;
+} lfm_song;
+
+typedef struct {
+	GMarkupParseContext *context;
+	gboolean valid;
+	gboolean ok;
+	gint error;
+	gchar *message;
+	gchar *key;
+	GArray *songs;
+	GString *text;
+} lfm_response;
+
+lfm_response *lfm_response_new(void);
+void lfm_response_free(lfm_response *response);
+void lfm_response_feed(const gchar *data, gsize length, gpointer response);
+gboolean lfm_response_finish(lfm_response *response);
+
+#endif // HAVE_LFM_H
@@ -0,0 +1,437 @@
+/**
+ * metrics.c: Prometheus metrics endpoint.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "audioscrobbler.h"
+#include "http.h"
+#include "misc.h"
+#include "mpd.h"
+#include "preferences.h"
+#include "profile.h"
+#include "queue.h"
+
+/* The metrics are served in the Prometheus text format to anything that
+ * connects to metrics_socket and sends an HTTP request. Every client is
+ * handled in the main loop, the request is read up to the empty line ending
+ * its header and then answered in full. */
+#define METRICS_MAX_REQUEST 8192
+
+typedef struct {
+	gint fd;
+	GString *data;
+	gsize written;
+} metrics_client;
+
+static const gdouble bucket_bounds[METRICS_BUCKETS] = {
+	0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static gint listen_fd = -1;
+static guint listen_source;
+static gchar *socket_path;
+
+gdouble metrics_observe(metrics_histogram *histogram, gint64 start)
+{
+	gdouble seconds = (gdouble)(g_get_monotonic_time() - start) /
+		G_USEC_PER_SEC;
+
+	for (guint i = 0; i < METRICS_BUCKETS; i++)
+		if (seconds <= bucket_bounds[i])
+			histogram->buckets[i]++;
+	histogram->count++;
+	histogram->sum += seconds;
+	return seconds;
+}
+
+static const gchar *subsystem_names[READY_COUNT] = {
+	"queue", "mpd", "audioscrobbler"
+};
+
+void metrics_ready(metrics_subsystem subsystem)
+{
+	if (metrics.ready[subsystem])
+		return;
+
+	// a subsystem which is ready takes more than 0 seconds
+	metrics.ready[subsystem] = MAX((gdouble)(g_get_monotonic_time() -
+				metrics.started) / G_USEC_PER_SEC, 1e-6);
+	g_message("Ready: %s after %.0f ms", subsystem_names[subsystem],
+			metrics.ready[subsystem] * 1000);
+}
+
+static void metrics_header(GString *out, const gchar *name,
+		const gchar *type, const gchar *help)
+{
+	g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name,
+			help, name, type);
+}
+
+static void metrics_value(GString *out, const gchar *name,
+		const gchar *type, const gchar *help, gdouble value)
+{
+	metrics_header(out, name, type, help);
+	g_string_append_printf(out, "%s %.10g\n", name, value);
+}
+
+static void metrics_put_histogram(GString *out, const gchar *name,
+		const gchar *labels, const metrics_histogram *histogram)
+{
+	const gchar *sep = *labels ? "," : "";
+
+	for (guint i = 0; i < METRICS_BUCKETS; i++)
+		g_string_append_printf(out, "%s_bucket{%s%sle=\"%g\"} %"
+				G_GUINT64_FORMAT "\n", name, labels, sep,
+				bucket_bounds[i], histogram->buckets[i]);
+	g_string_append_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %"
+			G_GUINT64_FORMAT "\n", name, labels, sep,
+			histogram->count);
+	g_string_append_printf(out, "%s_sum%s%s%s %.10g\n", name,
+			*labels ? "{" : "", labels, *labels ? "}" : "",
+			histogram->sum);
+	g_string_append_printf(out, "%s_count%s%s%s %" G_GUINT64_FORMAT "\n",
+			name, *labels ? "{" : "", labels, *labels ? "}" : "",
+			histogram->count);
+}
+
+static void metrics_put_dispatch(const gchar *name,
+		const metrics_histogram *histogram, gpointer data)
+{
+	gchar *labels = g_strdup_printf("callback=\"%s\"", name);
+
+	metrics_put_histogram(data, "scmpc_dispatch_duration_seconds", labels,
+			histogram);
+	g_free(labels);
+}
+
+static void metrics_render(GString *out)
+{
+	glong oldest = queue.first ? time(NULL) - queue.first->date : 0;
+
+	metrics_value(out, "scmpc_queue_songs", "gauge",
+			"Songs waiting to be submitted.",
+			queue.length + queue_on_disk());
+	metrics_value(out, "scmpc_queue_spilled_songs", "gauge",
+			"Queued songs kept on disk.", queue_on_disk());
+	metrics_value(out, "scmpc_queue_bytes", "gauge",
+			"Memory used by the queue.", queue_bytes());
+	metrics_value(out, "scmpc_queue_oldest_age_seconds", "gauge",
+			"Age of the oldest song waiting to be submitted.",
+			MAX(oldest, 0));
+	metrics_value(out, "scmpc_scrobbles_accepted_total", "counter",
+			"Songs accepted by Audioscrobbler.",
+			as_conn.accepted);
+	metrics_value(out, "scmpc_scrobbles_ignored_total", "counter",
+			"Songs ignored by Audioscrobbler.", as_conn.ignored);
+
+	metrics_header(out, "scmpc_request_duration_seconds", "histogram",
+			"Duration of Audioscrobbler requests.");
+	metrics_put_histogram(out, "scmpc_request_duration_seconds",
+			"type=\"submit\"", &metrics.submit);
+	metrics_put_histogram(out, "scmpc_request_duration_seconds",
+			"type=\"now_playing\"", &metrics.now_playing);
+	metrics_put_histogram(out, "scmpc_request_duration_seconds",
+			"type=\"auth\"", &metrics.auth);
+	metrics_header(out, "scmpc_request_errors_total", "counter",
+			"Failed Audioscrobbler requests.");
+	g_string_append_printf(out, "scmpc_request_errors_total"
+			"{type=\"submit\"} %" G_GUINT64_FORMAT "\n"
+			"scmpc_request_errors_total{type=\"now_playing\"} %"
+			G_GUINT64_FORMAT "\n"
+			"scmpc_request_errors_total{type=\"auth\"} %"
+			G_GUINT64_FORMAT "\n", metrics.submit_errors,
+			metrics.now_playing_errors, metrics.auth_errors);
+
+	metrics_value(out, "scmpc_http_requests_total", "counter",
+			"Finished HTTP requests.", http_stats.requests);
+	metrics_value(out, "scmpc_http_connects_total", "counter",
+			"New connections made for HTTP requests.",
+			http_stats.connects);
+	metrics_header(out, "scmpc_http_phase_seconds_total", "counter",
+			"Time spent in each phase of HTTP requests.");
+	g_string_append_printf(out, "scmpc_http_phase_seconds_total"
+			"{phase=\"dns\"} %.10g\n"
+			"scmpc_http_phase_seconds_total{phase=\"connect\"} "
+			"%.10g\n"
+			"scmpc_http_phase_seconds_total{phase=\"tls\"} %.10g\n"
+			"scmpc_http_phase_seconds_total{phase=\"ttfb\"} %.10g\n"
+			"scmpc_http_phase_seconds_total{phase=\"total\"} "
+			"%.10g\n", http_stats.dns / 1000,
+			http_stats.connect / 1000, http_stats.tls / 1000,
+			http_stats.ttfb / 1000, http_stats.total / 1000);
+
+	metrics_value(out, "scmpc_mpd_connected", "gauge",
+			"Whether there is a connection to MPD.",
+			mpd.connected);
+	metrics_value(out, "scmpc_mpd_connects_total", "counter",
+			"Connections made to MPD.", metrics.mpd_connects);
+	metrics_value(out, "scmpc_mpd_connect_failures_total", "counter",
+			"Failed attempts to connect to MPD.",
+			metrics.mpd_connect_failures);
+	metrics_value(out, "scmpc_mpd_disconnects_total", "counter",
+			"Lost connections to MPD.", metrics.mpd_disconnects);
+	metrics_header(out, "scmpc_mpd_event_handling_seconds", "histogram",
+			"Time taken to read and handle an MPD player event.");
+	metrics_put_histogram(out, "scmpc_mpd_event_handling_seconds", "",
+			&metrics.mpd_event);
+
+	metrics_header(out, "scmpc_cache_write_duration_seconds",
+			"histogram", "Time taken to write the cache file.");
+	metrics_put_histogram(out, "scmpc_cache_write_duration_seconds", "",
+			&metrics.cache_write);
+
+	metrics_header(out, "scmpc_ready_seconds", "gauge",
+			"Time from startup until each part was ready.");
+	for (guint i = 0; i < READY_COUNT; i++) {
+		if (metrics.ready[i])
+			g_string_append_printf(out, "scmpc_ready_seconds"
+					"{subsystem=\"%s\"} %.10g\n",
+					subsystem_names[i], metrics.ready[i]);
+	}
+
+	metrics_header(out, "scmpc_dispatch_duration_seconds", "histogram",
+			"Time spent in each main loop callback.");
+	profile_foreach(metrics_put_dispatch, out);
+}
+
+static void metrics_client_free(metrics_client *client)
+{
+	close(client->fd);
+	g_string_free(client->data, TRUE);
+	g_free(client);
+}
+
+static gboolean metrics_client_write(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition, gpointer data)
+{
+	metrics_client *client = data;
+	gssize ret = write(client->fd, client->data->str + client->written,
+			client->data->len - client->written);
+
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return TRUE;
+	if (ret > 0) {
+		client->written += ret;
+		if (client->written < client->data->len)
+			return TRUE;
+	}
+	metrics_client_free(client);
+	return FALSE;
+}
+
+static gboolean metrics_client_read(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition, gpointer data)
+{
+	metrics_client *client = data;
+	GIOChannel *channel;
+	GString *body;
+	gchar buf[1024];
+	gssize ret = read(client->fd, buf, sizeof buf);
+
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return TRUE;
+	if (ret <= 0) {
+		metrics_client_free(client);
+		return FALSE;
+	}
+
+	g_string_append_len(client->data, buf, ret);
+	if (!strstr(client->data->str, "\r\n\r\n") &&
+			!strstr(client->data->str, "\n\n")) {
+		if (client->data->len < METRICS_MAX_REQUEST)
+			return TRUE;
+		metrics_client_free(client);
+		return FALSE;
+	}
+
+	body = g_string_sized_new(8192);
+	metrics_render(body);
+	g_string_printf(client->data, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %lu\r\n\r\n", (gulong)body->len);
+	g_string_append_len(client->data, body->str, body->len);
+	g_string_free(body, TRUE);
+
+	channel = g_io_channel_unix_new(client->fd);
+	profile_io_add_watch(channel, G_IO_OUT | G_IO_HUP | G_IO_ERR,
+			metrics_client_write, client);
+	g_io_channel_unref(channel);
+	return FALSE;
+}
+
+static gboolean metrics_accept(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition,
+		G_GNUC_UNUSED gpointer data)
+{
+	metrics_client *client;
+	GIOChannel *channel;
+	gint fd = accept(listen_fd, NULL, NULL);
+
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			g_debug("Failed to accept metrics client: %s",
+					g_strerror(errno));
+		return TRUE;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	client = g_new0(metrics_client, 1);
+	client->fd = fd;
+	client->data = g_string_sized_new(256);
+	channel = g_io_channel_unix_new(fd);
+	profile_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+			metrics_client_read, client);
+	g_io_channel_unref(channel);
+	return TRUE;
+}
+
+/* metrics_socket is either the path of a UNIX socket or a port, optionally
+ * preceded by an address and a colon. Without an address only the loopback
+ * interface is used. */
+static gint metrics_bind(void)
+{
+	struct addrinfo hints = { 0 }, *res;
+	struct sockaddr_un addr = { 0 };
+	struct stat st;
+	const gchar *spec = prefs.metrics_socket, *end, *port;
+	gchar *host;
+	gint fd, ret, on = 1;
+
+	if (prefs.metrics_socket[0] == '/') {
+		addr.sun_family = AF_UNIX;
+		g_strlcpy(addr.sun_path, prefs.metrics_socket,
+				sizeof addr.sun_path);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+		// a socket left behind by an earlier run, but nothing else
+		if (lstat(prefs.metrics_socket, &st) == 0 &&
+				S_ISSOCK(st.st_mode))
+			unlink(prefs.metrics_socket);
+		if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+			ret = errno;
+			close(fd);
+			errno = ret;
+			return -1;
+		}
+		socket_path = g_strdup(prefs.metrics_socket);
+		return fd;
+	}
+
+	/* [address]:port, address:port or just a port. An IPv6 address has
+	 * to be in brackets, as its colons can't be told from the port's. */
+	if (spec[0] == '[' && (end = strchr(spec, ']')) && end[1] == ':') {
+		host = g_strndup(spec + 1, end - spec - 1);
+		port = end + 2;
+	} else if (spec[0] != '[' && (port = strchr(spec, ':')) &&
+			port == strrchr(spec, ':')) {
+		host = g_strndup(spec, port - spec);
+		port++;
+	} else if (spec[0] != '[' && !strchr(spec, ':')) {
+		host = g_strdup("127.0.0.1");
+		port = spec;
+	} else {
+		g_warning("Invalid metrics_socket %s: IPv6 addresses have to "
+				"be written as [address]:port", spec);
+		errno = EINVAL;
+		return -1;
+	}
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	ret = getaddrinfo(host, port, &hints, &res);
+	g_free(host);
+	if (ret) {
+		g_warning("Invalid metrics_socket %s: %s",
+				prefs.metrics_socket, gai_strerror(ret));
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((fd = socket(res->ai_family, res->ai_socktype,
+					res->ai_protocol)) < 0) {
+		freeaddrinfo(res);
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	if (bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		ret = errno;
+		close(fd);
+		freeaddrinfo(res);
+		errno = ret;
+		return -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+gboolean metrics_open(void)
+{
+	GIOChannel *channel;
+
+	if (!prefs.metrics_socket || !*prefs.metrics_socket)
+		return TRUE;
+
+	if ((listen_fd = metrics_bind()) < 0 || listen(listen_fd, 16) < 0) {
+		g_warning("Failed to open metrics socket %s: %s",
+				prefs.metrics_socket, g_strerror(errno));
+		metrics_close();
+		return FALSE;
+	}
+	fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+	fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+
+	channel = g_io_channel_unix_new(listen_fd);
+	listen_source = profile_io_add_watch(channel, G_IO_IN, metrics_accept,
+			NULL);
+	g_io_channel_unref(channel);
+	g_debug("Serving metrics on %s", prefs.metrics_socket);
+	return TRUE;
+}
+
+void metrics_close(void)
+{
+	if (listen_source)
+		g_source_remove(listen_source);
+	listen_source = 0;
+	if (listen_fd >= 0)
+		close(listen_fd);
+	listen_fd = -1;
+	if (socket_path)
+		unlink(socket_path);
+	g_free(socket_path);
+	socket_path = NULL;
+}
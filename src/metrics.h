@@ -0,0 +1,76 @@
+/**
+ * metrics.h: Prometheus metrics endpoint.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+
+#ifndef HAVE_METRICS_H
+#define HAVE_METRICS_H
+
+#include <glib.h>
+
+#define METRICS_BUCKETS 11
+
+/* The parts of scmpc whose time to get ready after startup is measured */
+typedef enum {
+	READY_QUEUE,
+	READY_MPD,
+	READY_AUDIOSCROBBLER,
+	READY_COUNT
+} metrics_subsystem;
+
+/* Cumulative counts of observations up to each bucket bound, in seconds */
+typedef struct {
+	guint64 buckets[METRICS_BUCKETS];
+	guint64 count;
+	gdouble sum;
+} metrics_histogram;
+
+struct {
+	metrics_histogram submit;
+	metrics_histogram now_playing;
+	metrics_histogram auth;
+	metrics_histogram mpd_event;
+	metrics_histogram cache_write;
+	guint64 submit_errors;
+	guint64 now_playing_errors;
+	guint64 auth_errors;
+	guint64 mpd_connects;
+	guint64 mpd_connect_failures;
+	guint64 mpd_disconnects;
+	gint64 started;
+	gdouble ready[READY_COUNT];
+} metrics;
+
+/* Record and return the seconds since start, a g_get_monotonic_time()
+ * timestamp */
+gdouble metrics_observe(metrics_histogram *histogram, gint64 start);
+/* Log and record the time from startup until subsystem first became
+ * ready, later calls are ignored */
+void metrics_ready(metrics_subsystem subsystem);
+
+gboolean metrics_open(void);
+void metrics_close(void);
+
+#endif // HAVE_METRICS_H
@@ -24,61 +24,278 @@
  */
 
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "misc.h"
-#include "audioscrobbler.h"
 #include "preferences.h"
 
-static FILE *log_file;
+/* Messages are formatted into a ring buffer and written to the log by a
+ * thread of their own, so logging never waits for the disk. The writer
+ * wakes up once the buffer is half full, or a second after the oldest
+ * pending message otherwise. Warnings and errors are waited for, they have
+ * to be in the log in case scmpc exits right after them. Before the thread
+ * is started, every message is written right away. */
+#define LOG_BUFFER_SIZE 65536
+
+static struct {
+	GMutex lock;
+	GCond cond;
+	gchar buffer[LOG_BUFFER_SIZE];
+	gsize start, length;
+	guint64 queued, written;
+	gint64 since;
+	gboolean flush, reopen, quit;
+	GThread *thread;
+	gint fd;
+	gchar *filename;
+	gchar *prefix;
+	time_t stamp_time;
+	gchar stamp[32];
+	gsize stamp_length;
+} logger = { .fd = -1 };
+
+static gint log_open_file(const gchar *filename)
+{
+	return open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+}
 
 void open_log(const gchar *filename)
 {
+	if (prefs.instance)
+		logger.prefix = g_strdup_printf("[%s] ", prefs.instance);
+
 	if (!prefs.fork) {
-		log_file = stdout;
+		logger.fd = STDOUT_FILENO;
 		return;
 	}
 
-	log_file = fopen(filename, "a");
-	if (!log_file) {
+	logger.fd = log_open_file(filename);
+	if (logger.fd < 0) {
 		fputs("Unable to open log file for writing,"
 				" logging to stdout\n", stderr);
-		log_file = stdout;
+		logger.fd = STDOUT_FILENO;
+		return;
+	}
+	logger.filename = g_strdup(filename);
+}
+
+/* Write out the oldest pending part of the buffer, called with the lock
+ * held. The lock is dropped while writing, messages are only added to the
+ * free part of the buffer in the meantime. */
+static void log_write(void)
+{
+	gsize length = MIN(logger.length, LOG_BUFFER_SIZE - logger.start);
+	const gchar *data = logger.buffer + logger.start;
+	gssize ret;
+
+	if (logger.thread)
+		g_mutex_unlock(&logger.lock);
+	for (gsize left = length; left; left -= ret, data += ret) {
+		ret = write(logger.fd, data, left);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret < 0)
+			break;
+	}
+	if (logger.thread)
+		g_mutex_lock(&logger.lock);
+
+	// whatever couldn't be written is lost, there's nowhere to report it
+	logger.start = (logger.start + length) % LOG_BUFFER_SIZE;
+	logger.length -= length;
+	logger.written += length;
+	if (!logger.length)
+		logger.flush = FALSE;
+	g_cond_broadcast(&logger.cond);
+}
+
+static void log_reopen_file(void)
+{
+	gint fd;
+
+	logger.reopen = FALSE;
+	if (!logger.filename)
+		return;
+
+	fd = log_open_file(logger.filename);
+	if (fd < 0)
+		return;
+	close(logger.fd);
+	logger.fd = fd;
+}
+
+static gpointer log_writer(G_GNUC_UNUSED gpointer data)
+{
+	g_mutex_lock(&logger.lock);
+	for (;;) {
+		if (logger.reopen)
+			log_reopen_file();
+
+		if (logger.length && (logger.flush || logger.quit ||
+					logger.length >= LOG_BUFFER_SIZE / 2 ||
+					g_get_monotonic_time() >=
+					logger.since + G_USEC_PER_SEC))
+			log_write();
+		else if (logger.quit)
+			break;
+		else if (logger.length)
+			g_cond_wait_until(&logger.cond, &logger.lock,
+					logger.since + G_USEC_PER_SEC);
+		else
+			g_cond_wait(&logger.cond, &logger.lock);
+	}
+	g_mutex_unlock(&logger.lock);
+	return NULL;
+}
+
+/* Start writing in the background, which has to wait until after forking */
+void start_log_writer(void)
+{
+	logger.thread = g_thread_new("log", log_writer, NULL);
+}
+
+/* Open the log file again, after it has been rotated */
+void reopen_log(void)
+{
+	g_mutex_lock(&logger.lock);
+	if (logger.thread) {
+		logger.reopen = TRUE;
+		g_cond_broadcast(&logger.cond);
+	} else {
+		log_reopen_file();
+	}
+	g_mutex_unlock(&logger.lock);
+}
+
+void close_log(void)
+{
+	GThread *thread = logger.thread;
+
+	if (thread) {
+		g_mutex_lock(&logger.lock);
+		logger.quit = TRUE;
+		g_cond_broadcast(&logger.cond);
+		g_mutex_unlock(&logger.lock);
+		g_thread_join(thread);
+		logger.thread = NULL;
 	}
+	if (logger.fd >= 0 && logger.fd != STDOUT_FILENO)
+		close(logger.fd);
+	logger.fd = -1;
+	g_free(logger.filename);
+	g_free(logger.prefix);
+	logger.filename = logger.prefix = NULL;
+}
+
+static void log_append(const gchar *data, gsize length)
+{
+	gsize end, part;
+
+	// a message which doesn't fit at all is cut off
+	length = MIN(length, LOG_BUFFER_SIZE);
+	while (logger.length + length > LOG_BUFFER_SIZE) {
+		if (!logger.thread) {
+			log_write();
+			continue;
+		}
+		logger.flush = TRUE;
+		g_cond_broadcast(&logger.cond);
+		g_cond_wait(&logger.cond, &logger.lock);
+	}
+
+	if (!logger.length)
+		logger.since = g_get_monotonic_time();
+	end = (logger.start + logger.length) % LOG_BUFFER_SIZE;
+	part = MIN(length, LOG_BUFFER_SIZE - end);
+	memcpy(logger.buffer + end, data, part);
+	memcpy(logger.buffer, data + part, length - part);
+	logger.length += length;
+	logger.queued += length;
 }
 
 void scmpc_log(G_GNUC_UNUSED const gchar *log_domain, GLogLevelFlags log_level,
 		const gchar *message, G_GNUC_UNUSED gpointer user_data)
 {
-	gchar *ts;
-	const gchar format[] = "%Y-%m-%d %H:%M:%S  ";
+	time_t now;
+	guint64 target;
 
-	if (log_level > prefs.log_level)
+	if ((log_level & G_LOG_LEVEL_MASK) > prefs.log_level || logger.fd < 0)
 		return;
 
-#if GLIB_CHECK_VERSION (2, 26, 0)
-	GDateTime *datetime = g_date_time_new_now_local();
-	ts = g_date_time_format(datetime, format);
-#else
-	time_t t = time(NULL);
-	ts = g_malloc(22);
-	strftime(ts, 22, format, localtime(&t));
-#endif
-	fputs(ts, log_file);
-	g_free(ts);
-#if GLIB_CHECK_VERSION (2, 26, 0)
-	g_date_time_unref(datetime);
-#endif
-
-	fputs(message, log_file);
-	fputs("\n", log_file);
-	fflush(log_file);
+	g_mutex_lock(&logger.lock);
+
+	// the timestamp only changes once a second
+	now = time(NULL);
+	if (now != logger.stamp_time || !logger.stamp_length) {
+		struct tm tm;
+		localtime_r(&now, &tm);
+		logger.stamp_length = strftime(logger.stamp,
+				sizeof logger.stamp, "%Y-%m-%d %H:%M:%S  ",
+				&tm);
+		logger.stamp_time = now;
+	}
+	log_append(logger.stamp, logger.stamp_length);
+	if (logger.prefix)
+		log_append(logger.prefix, strlen(logger.prefix));
+	log_append(message, strlen(message));
+	log_append("\n", 1);
+	target = logger.queued;
+
+	if (!logger.thread) {
+		while (logger.length)
+			log_write();
+	} else if ((log_level & G_LOG_LEVEL_MASK) <= G_LOG_LEVEL_WARNING) {
+		logger.flush = TRUE;
+		g_cond_broadcast(&logger.cond);
+		while (logger.written < target)
+			g_cond_wait(&logger.cond, &logger.lock);
+	} else if (logger.length >= LOG_BUFFER_SIZE / 2) {
+		g_cond_broadcast(&logger.cond);
+	}
+	g_mutex_unlock(&logger.lock);
 }
 
-gsize buffer_write(void *input, gsize size, gsize nmemb,
-		G_GNUC_UNUSED void *buf)
+guint32 crc32_checksum(const void *data, gsize len)
 {
-	gsize len = size*nmemb;
-	buffer = g_strdup(input);
-	return len;
+	static guint32 table[256];
+	static gsize table_ready;
+	const guchar *p = data;
+	guint32 crc = 0xffffffff;
+
+	/* The cache thread checksums as well, the table is built only once
+	 * by whichever thread gets here first */
+	if (g_once_init_enter(&table_ready)) {
+		for (guint32 i = 0; i < 256; i++) {
+			guint32 c = i;
+			for (gint k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		g_once_init_leave(&table_ready, 1);
+	}
+
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+/* Renames path to path.damaged, without replacing one which is there
+ * already. A file which doesn't exist is left as it is. */
+gboolean file_set_aside(const gchar *path)
+{
+	gchar *damaged = g_strconcat(path, ".damaged", NULL);
+	gboolean ret = TRUE;
+
+	if (link(path, damaged) < 0 ? errno != ENOENT : unlink(path) < 0) {
+		g_warning("Failed to move %s to %s: %s", path, damaged,
+				g_strerror(errno));
+		ret = FALSE;
+	}
+	g_free(damaged);
+	return ret;
 }
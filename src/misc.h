@@ -29,17 +29,31 @@
 
 #include <glib.h>
 
+#include "preferences.h"
+
 typedef enum {
 	DISCONNECTED,
+	CONNECTING,
 	CONNECTED,
 	BADAUTH
 } connection_status;
 
 void open_log(const gchar *filename);
+void start_log_writer(void);
+void reopen_log(void);
+void close_log(void);
 void scmpc_log(const gchar *log_domain, GLogLevelFlags log_level,
 		const gchar *message, gpointer user_data);
 
-/* used by curl */
-gsize buffer_write(void *input, gsize size, gsize nmemb, void *buf);
+/* Unlike the one of glib, this doesn't even format the message unless it
+ * is going to be logged, some of them are large */
+#undef g_debug
+#define g_debug(...) G_STMT_START { \
+	if (prefs.log_level >= G_LOG_LEVEL_DEBUG) \
+		g_log(G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, __VA_ARGS__); \
+} G_STMT_END
+
+guint32 crc32_checksum(const void *data, gsize len);
+gboolean file_set_aside(const gchar *path);
 
 #endif // HAVE_MISC_H
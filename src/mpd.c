@@ -24,112 +24,580 @@
  */
 
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 #include <mpd/client.h>
+#include <mpd/async.h>
 
 #include "mpd.h"
 #include "preferences.h"
+#include "probes.h"
+#include "profile.h"
 #include "audioscrobbler.h"
+#include "metrics.h"
+#include "misc.h"
 #include "queue.h"
+#include "retry.h"
 #include "scmpc.h"
+#include "trace.h"
+
+/* A host name is looked up in a thread of its own, so a dead name server
+ * can't stall the main loop. A lookup which is given up on, because the
+ * attempt timed out, is left to the thread to free. */
+typedef struct {
+	gchar *host;
+	gchar *port;
+	struct addrinfo *res;
+	gint ret;
+	gboolean finished;
+	gboolean abandoned;
+	GSource *done;
+} mpd_lookup;
 
-static void mpd_update(void);
-static void mpd_disconnect(void);
+static GMutex lookup_lock;
 
-gboolean mpd_connect(void)
+/* The connection is set up without blocking the main loop: the host name
+ * is resolved and the socket is connected in the background, and the
+ * welcome line is read as it arrives, only then is it handed over to
+ * libmpdclient. Failed attempts are retried after 250ms, doubling up to
+ * five minutes. */
+static struct {
+	gint fd;
+	mpd_lookup *lookup;
+	guint source;
+	guint timeout;
+	GString *welcome;
+	gint64 started;
+	backoff delay;
+#ifdef HAVE_SYS_INOTIFY_H
+	gint inotify_fd;
+	guint inotify_source;
+	gchar *socket_name;
+#endif
+} connection = {
+	.fd = -1,
+	.delay = { 250, 300000, 0 },
+#ifdef HAVE_SYS_INOTIFY_H
+	.inotify_fd = -1,
+#endif
+};
+
+static gboolean mpd_update(void);
+static void mpd_schedule_check(void);
+static void mpd_schedule_reconnect(void);
+
+/* Fetch the status and the current song in a single round trip. The song
+ * is only parsed when its id or the queue version differ from the last
+ * status, otherwise the rest of the response is skipped. */
+static gboolean mpd_sync(void)
 {
-	mpd.conn = mpd_connection_new(prefs.mpd_hostname, prefs.mpd_port,
-			prefs.mpd_interval * 1000);
-	if (mpd_connection_get_error(mpd.conn) != MPD_ERROR_SUCCESS) {
-		g_warning("Failed to connect to MPD: %s",
-				mpd_connection_get_error_message(mpd.conn));
+	struct mpd_status *status;
+	gboolean changed, ret;
+	gint64 start = g_get_monotonic_time();
+
+	if (!mpd_command_list_begin(mpd.conn, TRUE) ||
+			!mpd_send_status(mpd.conn) ||
+			!mpd_send_current_song(mpd.conn) ||
+			!mpd_command_list_end(mpd.conn))
+		return FALSE;
+
+	status = mpd_recv_status(mpd.conn);
+	if (!status)
 		return FALSE;
+
+	changed = !mpd.status || !mpd.song ||
+		mpd_status_get_song_id(status) !=
+			mpd_status_get_song_id(mpd.status) ||
+		mpd_status_get_queue_version(status) !=
+			mpd_status_get_queue_version(mpd.status);
+
+	if (mpd.status)
+		mpd_status_free(mpd.status);
+	mpd.status = status;
+
+	if (changed) {
+		if (mpd.song)
+			mpd_song_free(mpd.song);
+		mpd.song = NULL;
+		if (mpd_response_next(mpd.conn))
+			mpd.song = mpd_recv_song(mpd.conn);
+	}
+	ret = mpd_response_finish(mpd.conn);
+	trace_span("mpd", "status", start, "song", changed ? "changed" :
+			"unchanged", NULL);
+	return ret;
+}
+
+static void mpd_lookup_free(mpd_lookup *lookup)
+{
+	if (lookup->res)
+		freeaddrinfo(lookup->res);
+	g_source_unref(lookup->done);
+	g_free(lookup->host);
+	g_free(lookup->port);
+	g_free(lookup);
+}
+
+static void mpd_lookup_abandon(mpd_lookup *lookup)
+{
+	gboolean finished;
+
+	g_mutex_lock(&lookup_lock);
+	finished = lookup->finished;
+	lookup->abandoned = TRUE;
+	g_mutex_unlock(&lookup_lock);
+
+	// the result is already waiting for the main loop
+	if (finished) {
+		g_source_destroy(lookup->done);
+		mpd_lookup_free(lookup);
+	}
+}
+
+static void mpd_connect_cancel(void)
+{
+	if (connection.lookup)
+		mpd_lookup_abandon(connection.lookup);
+	connection.lookup = NULL;
+	if (connection.source)
+		g_source_remove(connection.source);
+	if (connection.timeout)
+		g_source_remove(connection.timeout);
+	connection.source = connection.timeout = 0;
+	if (connection.fd >= 0)
+		close(connection.fd);
+	connection.fd = -1;
+	if (connection.welcome)
+		g_string_free(connection.welcome, TRUE);
+	connection.welcome = NULL;
+}
+
+static void mpd_connect_failed(const gchar *error)
+{
+	g_warning("Failed to connect to MPD: %s", error);
+	metrics.mpd_connect_failures++;
+	trace_span("mpd", "connect", connection.started, "result", error,
+			NULL);
+	mpd_connect_cancel();
+	mpd_schedule_reconnect();
+}
+
+static gboolean mpd_connect_timeout(G_GNUC_UNUSED gpointer data)
+{
+	connection.timeout = 0;
+	mpd_connect_failed("Timeout");
+	return FALSE;
+}
+
+static void mpd_connect_finish(void)
+{
+	struct mpd_async *async;
+
+	g_source_remove(connection.timeout);
+	connection.source = connection.timeout = 0;
+	g_strchomp(connection.welcome->str);
+
+	// libmpdclient owns the socket from here on
+	async = mpd_async_new(connection.fd);
+	connection.fd = -1;
+	mpd.conn = async ? mpd_connection_new_async(async,
+			connection.welcome->str) : NULL;
+	g_string_free(connection.welcome, TRUE);
+	connection.welcome = NULL;
+
+	if (!mpd.conn) {
+		mpd_connect_failed("Out of memory");
+		return;
+	} else if (mpd_connection_get_error(mpd.conn) != MPD_ERROR_SUCCESS) {
+		mpd_connect_failed(mpd_connection_get_error_message(mpd.conn));
+		mpd_connection_free(mpd.conn);
+		mpd.conn = NULL;
+		return;
 	} else if (mpd_connection_cmp_server_version(mpd.conn, 0, 14, 0) < 0) {
 		g_critical("MPD too old, please upgrade to 0.14 or newer");
+		mpd_connection_free(mpd.conn);
+		mpd.conn = NULL;
 		scmpc_shutdown();
-		return FALSE;
-	} else {
-		mpd_command_list_begin(mpd.conn, TRUE);
-		mpd_send_status(mpd.conn);
-		mpd_send_current_song(mpd.conn);
-		mpd_command_list_end(mpd.conn);
+		return;
+	}
+	mpd_connection_set_timeout(mpd.conn, prefs.mpd_timeout * 1000);
+
+	// the last connection may have left a different song behind
+	if (mpd.status)
+		mpd_status_free(mpd.status);
+	mpd.status = NULL;
 
-		mpd.status = mpd_recv_status(mpd.conn);
-		mpd_response_next(mpd.conn);
-		mpd.song = mpd_recv_song(mpd.conn);
-		mpd_response_finish(mpd.conn);
+	if (!mpd_sync()) {
+		g_warning("Failed to read MPD status: %s",
+				mpd_connection_get_error_message(mpd.conn));
+		mpd_disconnect();
+		return;
+	}
 
-		g_message("Connected to MPD");
+	g_message("Connected to MPD");
+	mpd.connected = TRUE;
+	metrics.mpd_connects++;
+	metrics_ready(READY_MPD);
+	trace_span("mpd", "connect", connection.started, "result", "ok",
+			NULL);
+	backoff_reset(&connection.delay);
 
-		// only send now playing, don't queue the song
-		if (mpd_status_get_state(mpd.status) == MPD_STATE_PLAY)
-			as_now_playing();
-		mpd.song_submitted = TRUE;
+	// only send now playing, don't queue the song
+	mpd.song_announced = mpd_status_get_state(mpd.status) ==
+		MPD_STATE_PLAY;
+	if (mpd.song_announced)
+		as_now_playing();
+	mpd.song_submitted = TRUE;
 
-		mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+	mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
 
-		GIOChannel *channel = g_io_channel_unix_new(
-				mpd_connection_get_fd(mpd.conn));
-		mpd.source = g_io_add_watch(channel, G_IO_IN | G_IO_HUP,
-				mpd_parse, NULL);
-		g_io_channel_unref(channel);
+	GIOChannel *channel = g_io_channel_unix_new(
+			mpd_connection_get_fd(mpd.conn));
+	mpd.source = profile_io_add_watch(channel, G_IO_IN | G_IO_HUP,
+			mpd_parse, NULL);
+	g_io_channel_unref(channel);
+}
+
+static gboolean mpd_connect_welcome(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition,
+		G_GNUC_UNUSED gpointer data)
+{
+	gchar buf[256];
+	gssize ret = read(connection.fd, buf, sizeof buf);
 
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
 		return TRUE;
+	if (ret <= 0) {
+		connection.source = 0;
+		mpd_connect_failed(ret < 0 ? g_strerror(errno) :
+				"Connection closed");
+		return FALSE;
 	}
+
+	g_string_append_len(connection.welcome, buf, ret);
+	if (!memchr(buf, '\n', ret)) {
+		if (connection.welcome->len < 1024)
+			return TRUE;
+		connection.source = 0;
+		mpd_connect_failed("Malformed welcome message");
+		return FALSE;
+	}
+
+	mpd_connect_finish();
+	return FALSE;
 }
 
-static void mpd_update(void)
+static gboolean mpd_connect_ready(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition,
+		G_GNUC_UNUSED gpointer data)
 {
-	struct mpd_status *prev = mpd.status;
+	GIOChannel *channel;
+	gint error = 0;
+	socklen_t len = sizeof error;
 
-	if (mpd.status)
-		mpd_status_free(mpd.status);
-	mpd.status = mpd_run_status(mpd.conn);
-	mpd_response_finish(mpd.conn);
-
-	if (mpd_status_get_state(mpd.status) == MPD_STATE_PLAY) {
-		if (mpd_status_get_state(prev) == MPD_STATE_PLAY ||
-				mpd_status_get_state(prev) == MPD_STATE_STOP) {
-			GTimeVal tv;
-			g_get_current_time(&tv);
-
-			// XXX time < xfade+5? wtf?
-			// initialize new song
-			if (mpd.song)
-				mpd_song_free(mpd.song);
-			mpd.song = mpd_run_current_song(mpd.conn);
-			mpd_response_finish(mpd.conn);
-			g_timer_start(mpd.song_pos);
-			mpd.song_date = tv.tv_sec;
-
-			// update previous songs
-			mpd.song_submitted = FALSE;
-			if (queue.length > 0)
-				queue.last->finished_playing = TRUE;
-			// submit previous song(s)
-			as_check_submit();
-
-			// send now playing at the end so it won't be
-			// overwritten by the queue
-			as_now_playing();
-		} else if (mpd_status_get_state(prev) == MPD_STATE_PAUSE) {
-			g_timer_continue(mpd.song_pos);
+	connection.source = 0;
+	if (getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+		error = errno;
+	if (error) {
+		mpd_connect_failed(g_strerror(error));
+		return FALSE;
+	}
+
+	// wait for the welcome line
+	connection.welcome = g_string_sized_new(32);
+	channel = g_io_channel_unix_new(connection.fd);
+	connection.source = profile_io_add_watch(channel, G_IO_IN | G_IO_HUP |
+			G_IO_ERR, mpd_connect_welcome, NULL);
+	g_io_channel_unref(channel);
+	return FALSE;
+}
+
+static gint mpd_connect_socket(const struct sockaddr *addr, socklen_t len,
+		const gchar **error)
+{
+	gint fd, ret;
+
+	if ((fd = socket(addr->sa_family, SOCK_STREAM, 0)) < 0) {
+		*error = g_strerror(errno);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	ret = connect(fd, addr, len);
+
+	if (ret < 0 && errno != EINPROGRESS) {
+		*error = g_strerror(errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Wait for the socket to be connected */
+static void mpd_connect_wait(gint fd, const gchar *error)
+{
+	GIOChannel *channel;
+
+	if (fd < 0) {
+		mpd_connect_failed(error);
+		return;
+	}
+
+	connection.fd = fd;
+	channel = g_io_channel_unix_new(connection.fd);
+	connection.source = profile_io_add_watch(channel, G_IO_OUT | G_IO_ERR |
+			G_IO_HUP, mpd_connect_ready, NULL);
+	g_io_channel_unref(channel);
+}
+
+static gpointer mpd_lookup_run(gpointer data)
+{
+	mpd_lookup *lookup = data;
+	struct addrinfo hints = { 0 };
+	gboolean abandoned;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	lookup->ret = getaddrinfo(lookup->host, lookup->port, &hints,
+			&lookup->res);
+
+	g_mutex_lock(&lookup_lock);
+	lookup->finished = TRUE;
+	abandoned = lookup->abandoned;
+	if (!abandoned)
+		g_source_attach(lookup->done, NULL);
+	g_mutex_unlock(&lookup_lock);
+
+	if (abandoned)
+		mpd_lookup_free(lookup);
+	return NULL;
+}
+
+static gboolean mpd_lookup_done(gpointer data)
+{
+	mpd_lookup *lookup = data;
+	const gchar *error = NULL;
+	gint fd = -1;
+
+	connection.lookup = NULL;
+	if (lookup->ret)
+		error = gai_strerror(lookup->ret);
+	else
+		fd = mpd_connect_socket(lookup->res->ai_addr,
+				lookup->res->ai_addrlen, &error);
+	mpd_connect_wait(fd, error);
+	mpd_lookup_free(lookup);
+	return FALSE;
+}
+
+static void mpd_lookup_start(void)
+{
+	mpd_lookup *lookup = g_new0(mpd_lookup, 1);
+
+	lookup->host = g_strdup(prefs.mpd_hostname);
+	lookup->port = g_strdup_printf("%d", prefs.mpd_port);
+	lookup->done = profile_idle_source_new(G_PRIORITY_DEFAULT,
+			mpd_lookup_done, lookup);
+	connection.lookup = lookup;
+	g_thread_unref(g_thread_new("resolve", mpd_lookup_run, lookup));
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static gboolean mpd_socket_event(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition,
+		G_GNUC_UNUSED gpointer data)
+{
+	union {
+		struct inotify_event event;
+		gchar data[4096];
+	} buf;
+	const struct inotify_event *event;
+	gboolean created = FALSE;
+	gssize ret;
+
+	while ((ret = read(connection.inotify_fd, &buf, sizeof buf)) > 0) {
+		for (gchar *p = buf.data; p < buf.data + ret;
+				p += sizeof *event + event->len) {
+			event = (const struct inotify_event *)p;
+			if (event->len && !strcmp(event->name,
+						connection.socket_name))
+				created = TRUE;
 		}
-	} else if (mpd_status_get_state(mpd.status) == MPD_STATE_PAUSE) {
-		if (mpd_status_get_state(prev) == MPD_STATE_PLAY)
+	}
+
+	// MPD is back, don't wait for the next attempt
+	if (created && mpd.reconnect_source) {
+		g_debug("MPD socket reappeared, reconnecting");
+		g_source_remove(mpd.reconnect_source);
+		mpd.reconnect_source = 0;
+		backoff_reset(&connection.delay);
+		mpd_connect();
+	}
+	return TRUE;
+}
+
+/* Watch the directory of a UNIX socket, so a restarted MPD is noticed as
+ * soon as it creates its socket again */
+static void mpd_watch_socket(void)
+{
+	GIOChannel *channel;
+	gchar *dir;
+
+	if (connection.inotify_fd >= 0 || prefs.mpd_hostname[0] != '/')
+		return;
+
+	connection.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (connection.inotify_fd < 0) {
+		g_debug("Failed to initialise inotify: %s",
+				g_strerror(errno));
+		return;
+	}
+
+	dir = g_path_get_dirname(prefs.mpd_hostname);
+	if (inotify_add_watch(connection.inotify_fd, dir,
+				IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0) {
+		g_debug("Failed to watch %s: %s", dir, g_strerror(errno));
+		close(connection.inotify_fd);
+		connection.inotify_fd = -1;
+		g_free(dir);
+		return;
+	}
+	g_free(dir);
+
+	connection.socket_name = g_path_get_basename(prefs.mpd_hostname);
+	channel = g_io_channel_unix_new(connection.inotify_fd);
+	connection.inotify_source = profile_io_add_watch(channel, G_IO_IN,
+			mpd_socket_event, NULL);
+	g_io_channel_unref(channel);
+}
+#endif
+
+/* Start connecting to MPD, mpd.connected is set once that has finished */
+void mpd_connect(void)
+{
+	struct sockaddr_un addr = { 0 };
+	const gchar *error = NULL;
+	gint fd;
+
+	if (mpd.connected || connection.fd >= 0 || connection.lookup)
+		return;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	mpd_watch_socket();
+#endif
+
+	// the timeout covers the lookup as well
+	connection.started = g_get_monotonic_time();
+	connection.timeout = profile_timeout_add_seconds(prefs.mpd_timeout,
+			mpd_connect_timeout, NULL);
+
+	if (prefs.mpd_hostname[0] != '/') {
+		mpd_lookup_start();
+		return;
+	}
+
+	addr.sun_family = AF_UNIX;
+	g_strlcpy(addr.sun_path, prefs.mpd_hostname, sizeof addr.sun_path);
+	fd = mpd_connect_socket((struct sockaddr *)&addr, sizeof addr, &error);
+	mpd_connect_wait(fd, error);
+}
+
+static gboolean mpd_update(void)
+{
+	enum mpd_state prev = mpd_status_get_state(mpd.status);
+	gint prev_id = mpd_status_get_song_id(mpd.status);
+	enum mpd_state state;
+	gboolean new_song;
+
+	if (!mpd_sync())
+		return FALSE;
+	state = mpd_status_get_state(mpd.status);
+
+	/* A different song id means a new song, the same one means a seek,
+	 * unless it started over from the beginning, as with repeat on a
+	 * single song */
+	new_song = prev == MPD_STATE_STOP ||
+		mpd_status_get_song_id(mpd.status) != prev_id ||
+		(prev == MPD_STATE_PLAY &&
+		 mpd_status_get_elapsed_time(mpd.status) == 0 &&
+		 g_timer_elapsed(mpd.song_pos, NULL) >= 1);
+	if (new_song || state != prev)
+		PROBE3(mpd_state, prev, state, new_song);
+
+	/* A new song resets the song state whether it is playing or not, a
+	 * song which changes while paused is only announced once it plays */
+	if (new_song && state != MPD_STATE_STOP) {
+		GTimeVal tv;
+		g_get_current_time(&tv);
+
+		trace_scrobble('e', "scrobble", mpd.song_trace, "result",
+				"skipped", NULL);
+
+		// XXX time < xfade+5? wtf?
+		// initialize new song
+		g_timer_start(mpd.song_pos);
+		if (state == MPD_STATE_PAUSE)
 			g_timer_stop(mpd.song_pos);
-	} else if (mpd_status_get_state(mpd.status) == MPD_STATE_STOP) {
+		mpd.song_date = tv.tv_sec;
+
+		// update previous songs
+		mpd.song_submitted = FALSE;
+		mpd.song_announced = FALSE;
+		mpd.song_trace = trace_scrobble_begin("scrobble",
+				"artist", mpd_song_get_tag(mpd.song,
+					MPD_TAG_ARTIST, 0),
+				"title", mpd_song_get_tag(mpd.song,
+					MPD_TAG_TITLE, 0), NULL);
+		queue_finish_last();
+		// submit previous song(s)
+		as_check_submit();
+	} else if (state == MPD_STATE_PLAY) {
+		if (prev == MPD_STATE_PAUSE)
+			g_timer_continue(mpd.song_pos);
+	} else if (state == MPD_STATE_PAUSE) {
+		if (prev == MPD_STATE_PLAY)
+			g_timer_stop(mpd.song_pos);
+	} else if (state == MPD_STATE_STOP) {
+		// a song which was stopped won't be queued any more
+		trace_scrobble('e', "scrobble", mpd.song_trace, "result",
+				"stopped", NULL);
+		mpd.song_trace = 0;
 		as_check_submit();
 	}
+
+	// send now playing at the end so it won't be overwritten by the queue
+	if (state == MPD_STATE_PLAY && !mpd.song_announced) {
+		mpd.song_announced = TRUE;
+		as_now_playing();
+	}
+
+	// the song, its position or the state may have changed
+	mpd_schedule_check();
+	return TRUE;
 }
 
 gboolean mpd_parse(G_GNUC_UNUSED GIOChannel *source, GIOCondition condition,
 		G_GNUC_UNUSED gpointer data)
 {
 	if (condition & G_IO_HUP) {
-		mpd_disconnect();
 		g_message("Disconnected from MPD, reconnecting");
-		return TRUE;
+		mpd_disconnect();
+		return FALSE;
 	} else if (condition & G_IO_IN) {
+		gint64 start = g_get_monotonic_time();
 		enum mpd_idle events = mpd_recv_idle(mpd.conn, FALSE);
 
 		if (!mpd_response_finish(mpd.conn)) {
@@ -140,9 +608,15 @@ gboolean mpd_parse(G_GNUC_UNUSED GIOChannel *source, GIOCondition condition,
 			return FALSE;
 		}
 
-		if (events & MPD_IDLE_PLAYER) {
-			mpd_update();
+		if ((events & MPD_IDLE_PLAYER) && !mpd_update()) {
+			g_warning("Failed to update MPD status: %s",
+					mpd_connection_get_error_message(
+						mpd.conn));
+			mpd_disconnect();
+			return FALSE;
 		}
+		if (events & MPD_IDLE_PLAYER)
+			metrics_observe(&metrics.mpd_event, start);
 
 		mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
 		return TRUE;
@@ -152,24 +626,112 @@ gboolean mpd_parse(G_GNUC_UNUSED GIOChannel *source, GIOCondition condition,
 	}
 }
 
-gboolean mpd_reconnect(G_GNUC_UNUSED gpointer data)
+static gboolean mpd_reconnect(G_GNUC_UNUSED gpointer data)
 {
-	if (mpd.connected)
-		return TRUE;
+	mpd.reconnect_source = 0;
+	mpd_connect();
+	return FALSE;
+}
 
-	mpd.connected = mpd_connect();
-	if (!mpd.connected) {
-		mpd_disconnect();
-		return TRUE;
-	}
+static void mpd_schedule_reconnect(void)
+{
+	guint delay;
 
-	return TRUE;
+	if (mpd.reconnect_source)
+		return;
+	delay = backoff_next(&connection.delay);
+	g_debug("Reconnecting to MPD in %u ms", delay);
+	mpd.reconnect_source = profile_timeout_add(delay, mpd_reconnect, NULL);
 }
 
-static void mpd_disconnect(void)
+void mpd_disconnect(void)
 {
+	/* The watch is removed by returning FALSE from mpd_parse() */
+	mpd.source = 0;
+	if (mpd.check_source) {
+		g_source_remove(mpd.check_source);
+		mpd.check_source = 0;
+	}
 	if (mpd.conn)
 		mpd_connection_free(mpd.conn);
+	if (mpd.connected)
+		metrics.mpd_disconnects++;
 	mpd.connected = FALSE;
 	mpd.conn = NULL;
+
+	// the timer only runs while there is no connection
+	mpd_schedule_reconnect();
+}
+
+void mpd_cleanup(void)
+{
+	if (mpd.source)
+		g_source_remove(mpd.source);
+	if (mpd.check_source)
+		g_source_remove(mpd.check_source);
+	if (mpd.reconnect_source)
+		g_source_remove(mpd.reconnect_source);
+	mpd.source = mpd.check_source = mpd.reconnect_source = 0;
+	mpd_connect_cancel();
+#ifdef HAVE_SYS_INOTIFY_H
+	if (connection.inotify_source)
+		g_source_remove(connection.inotify_source);
+	if (connection.inotify_fd >= 0)
+		close(connection.inotify_fd);
+	connection.inotify_source = 0;
+	connection.inotify_fd = -1;
+	g_free(connection.socket_name);
+	connection.socket_name = NULL;
+#endif
+	if (mpd.conn)
+		mpd_connection_free(mpd.conn);
+	mpd.conn = NULL;
+	mpd.connected = FALSE;
+}
+
+gboolean mpd_song_eligible(void)
+{
+	if (!mpd.song)
+		return FALSE;
+
+	return (!mpd.song_submitted &&
+			(g_timer_elapsed(mpd.song_pos, NULL) >= 240 ||
+			 g_timer_elapsed(mpd.song_pos, NULL) >=
+				mpd_song_get_duration(mpd.song) / 2));
+}
+
+static gboolean mpd_check(G_GNUC_UNUSED gpointer data)
+{
+	mpd.check_source = 0;
+	// the timer may fire a little early, arm it again in that case
+	if (mpd_song_eligible()) {
+		trace_scrobble('n', "eligible", mpd.song_trace, NULL);
+		queue_add_current_song();
+	}
+	else
+		mpd_schedule_check();
+	return FALSE;
+}
+
+/* Arm a single timer for the moment the current song becomes eligible for
+ * submission, which is after half its length or four minutes, whichever
+ * comes first. It is only running while a song which hasn't been queued yet
+ * is playing. */
+static void mpd_schedule_check(void)
+{
+	guint deadline;
+	gdouble elapsed;
+
+	if (mpd.check_source) {
+		g_source_remove(mpd.check_source);
+		mpd.check_source = 0;
+	}
+	if (!mpd.song || mpd.song_submitted || !mpd.status ||
+			mpd_status_get_state(mpd.status) != MPD_STATE_PLAY)
+		return;
+
+	deadline = MIN(240, mpd_song_get_duration(mpd.song) / 2);
+	elapsed = g_timer_elapsed(mpd.song_pos, NULL);
+	mpd.check_source = profile_timeout_add_seconds(elapsed < deadline ?
+			(guint)(deadline - elapsed) + 1 : 0, mpd_check, NULL);
 }
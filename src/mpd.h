@@ -33,10 +33,16 @@ struct {
 	GTimer *song_pos;
 	gint song_date;
 	gboolean song_submitted;
+	gboolean song_announced;
+	guint song_trace;
 	guint source;
+	guint check_source;
+	guint reconnect_source;
 	gboolean connected;
 } mpd;
 
-gboolean mpd_connect(void);
+void mpd_connect(void);
 gboolean mpd_parse(GIOChannel *source, GIOCondition condition, gpointer data);
-gboolean mpd_reconnect(gpointer data);
+void mpd_disconnect(void);
+void mpd_cleanup(void);
+gboolean mpd_song_eligible(void);
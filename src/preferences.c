@@ -80,6 +80,17 @@ static gint cf_validate_num_zero(cfg_t *cfg, cfg_opt_t *opt)
 	return 0;
 }
 
+static gint cf_validate_batch_songs(cfg_t *cfg, cfg_opt_t *opt)
+{
+	gint value = cfg_opt_getnint(opt, 0);
+	if (value <= 0 || value > 50) {
+		cfg_error(cfg, "'%s' in section '%s' has to be between 1 and "
+				"50.", cfg_opt_name(opt), cfg_name(cfg));
+		return -1;
+	}
+	return 0;
+}
+
 static void free_config_files(gchar **config_files)
 {
 	for (int i = 0; i < 3; i++)
@@ -99,7 +110,7 @@ static gint parse_files(cfg_t *cfg)
 		config_files[1] = g_strdup_printf("%s/.scmpc/scmpc.conf", home);
 		config_files[2] = g_strdup(SYSCONFDIR "/scmpc.conf");
 	} else {
-		config_files[0] = prefs.config_file;
+		config_files[0] = g_strdup(prefs.config_file);
 		config_files[1] = g_strdup("");
 		config_files[2] = g_strdup("");
 	}
@@ -140,9 +151,85 @@ static char* expand_tilde(const char *path)
 	return g_strdup(path);
 }
 
+/* Settings of an instance section override the global ones, anything it
+ * doesn't set is inherited */
+static gint apply_instance(cfg_t *cfg)
+{
+	cfg_t *sec, *sec_mpd, *sec_as;
+	const gchar *value;
+
+	if (!(sec = cfg_gettsec(cfg, "instance", prefs.instance))) {
+		fprintf(stderr, "Instance '%s' is not configured.\n",
+				prefs.instance);
+		return -1;
+	}
+
+	if ((value = cfg_getstr(sec, "cache_file"))) {
+		g_free(prefs.cache_file);
+		prefs.cache_file = expand_tilde(value);
+	} else {
+		// instances can't share a cache file
+		gchar *cache_file = g_strdup_printf("%s.%s", prefs.cache_file,
+				prefs.instance);
+		g_free(prefs.cache_file);
+		prefs.cache_file = cache_file;
+	}
+
+	if ((value = cfg_getstr(sec, "metrics_socket"))) {
+		g_free(prefs.metrics_socket);
+		prefs.metrics_socket = expand_tilde(value);
+	} else if (prefs.metrics_socket[0] == '/') {
+		gchar *metrics_socket = g_strdup_printf("%s.%s",
+				prefs.metrics_socket, prefs.instance);
+		g_free(prefs.metrics_socket);
+		prefs.metrics_socket = metrics_socket;
+	} else if (prefs.metrics_socket[0]) {
+		// a port can only be used by one of them
+		g_free(prefs.metrics_socket);
+		prefs.metrics_socket = g_strdup("");
+	}
+
+	if (prefs.trace_file[0]) {
+		gchar *trace_file = g_strdup_printf("%s.%s", prefs.trace_file,
+				prefs.instance);
+		g_free(prefs.trace_file);
+		prefs.trace_file = trace_file;
+	}
+
+	sec_mpd = cfg_getsec(sec, "mpd");
+	if ((value = cfg_getstr(sec_mpd, "host"))) {
+		g_free(prefs.mpd_hostname);
+		prefs.mpd_hostname = g_strdup(value);
+	}
+	if (cfg_getint(sec_mpd, "port"))
+		prefs.mpd_port = cfg_getint(sec_mpd, "port");
+	if (cfg_getint(sec_mpd, "timeout"))
+		prefs.mpd_timeout = cfg_getint(sec_mpd, "timeout");
+	if ((value = cfg_getstr(sec_mpd, "password"))) {
+		g_free(prefs.mpd_password);
+		prefs.mpd_password = g_strdup(value);
+	}
+
+	sec_as = cfg_getsec(sec, "audioscrobbler");
+	if ((value = cfg_getstr(sec_as, "username"))) {
+		g_free(prefs.as_username);
+		prefs.as_username = g_strdup(value);
+	}
+	if ((value = cfg_getstr(sec_as, "password"))) {
+		g_free(prefs.as_password);
+		prefs.as_password = g_strdup(value);
+	}
+	if ((value = cfg_getstr(sec_as, "password_hash"))) {
+		g_free(prefs.as_password_hash);
+		prefs.as_password_hash = g_strdup(value);
+	}
+	return 0;
+}
+
 static gint parse_config_file(void)
 {
 	cfg_t *cfg, *sec_as, *sec_mpd;
+	guint instances;
 
 	cfg_opt_t mpd_opts[] = {
 		CFG_STR("host", "localhost", CFGF_NONE),
@@ -156,6 +243,30 @@ static gint parse_config_file(void)
 		CFG_STR("username", "", CFGF_NONE),
 		CFG_STR("password", "", CFGF_NONE),
 		CFG_STR("password_hash", "", CFGF_NONE),
+		CFG_INT("batches", 2, CFGF_NONE),
+		CFG_INT("batch_songs", 10, CFGF_NONE),
+		CFG_INT("batch_delay", 180, CFGF_NONE),
+		CFG_INT("now_playing_delay", 3, CFGF_NONE),
+		CFG_END()
+	};
+	cfg_opt_t instance_mpd_opts[] = {
+		CFG_STR("host", NULL, CFGF_NONE),
+		CFG_INT("port", 0, CFGF_NONE),
+		CFG_INT("timeout", 0, CFGF_NONE),
+		CFG_STR("password", NULL, CFGF_NONE),
+		CFG_END()
+	};
+	cfg_opt_t instance_as_opts[] = {
+		CFG_STR("username", NULL, CFGF_NONE),
+		CFG_STR("password", NULL, CFGF_NONE),
+		CFG_STR("password_hash", NULL, CFGF_NONE),
+		CFG_END()
+	};
+	cfg_opt_t instance_opts[] = {
+		CFG_STR("cache_file", NULL, CFGF_NONE),
+		CFG_STR("metrics_socket", NULL, CFGF_NONE),
+		CFG_SEC("mpd", instance_mpd_opts, CFGF_NONE),
+		CFG_SEC("audioscrobbler", instance_as_opts, CFGF_NONE),
 		CFG_END()
 	};
 	cfg_opt_t opts[] = {
@@ -166,17 +277,29 @@ static gint parse_config_file(void)
 		CFG_STR("cache_file", "/var/lib/scmpc/scmpc.cache", CFGF_NONE),
 		CFG_INT("queue_length", 500, CFGF_NONE),
 		CFG_INT("cache_interval", 10, CFGF_NONE),
+		CFG_STR("metrics_socket", "", CFGF_NONE),
+		CFG_INT("stall_threshold", 100, CFGF_NONE),
+		CFG_STR("trace_file", "", CFGF_NONE),
 		CFG_SEC("mpd", mpd_opts, CFGF_NONE),
 		CFG_SEC("audioscrobbler", as_opts, CFGF_NONE),
+		CFG_SEC("instance", instance_opts, CFGF_MULTI | CFGF_TITLE),
 		CFG_END()
 	};
 
 	cfg = cfg_init(opts, CFGF_NONE);
 	cfg_set_validate_func(cfg, "queue_length", &cf_validate_num);
 	cfg_set_validate_func(cfg, "cache_interval", &cf_validate_num_zero);
+	cfg_set_validate_func(cfg, "stall_threshold", &cf_validate_num_zero);
 	cfg_set_validate_func(cfg, "mpd|port", &cf_validate_num);
 	cfg_set_validate_func(cfg, "mpd|timeout", &cf_validate_num);
 	cfg_set_validate_func(cfg, "mpd|interval", &cf_validate_num);
+	cfg_set_validate_func(cfg, "audioscrobbler|batches", &cf_validate_num);
+	cfg_set_validate_func(cfg, "audioscrobbler|batch_songs",
+			&cf_validate_batch_songs);
+	cfg_set_validate_func(cfg, "audioscrobbler|batch_delay",
+			&cf_validate_num_zero);
+	cfg_set_validate_func(cfg, "audioscrobbler|now_playing_delay",
+			&cf_validate_num_zero);
 
 	if (parse_files(cfg) < 0) {
 		cfg_free(cfg);
@@ -186,6 +309,8 @@ static gint parse_config_file(void)
 	g_free(prefs.log_file);
 	g_free(prefs.pid_file);
 	g_free(prefs.cache_file);
+	g_free(prefs.metrics_socket);
+	g_free(prefs.trace_file);
 	g_free(prefs.mpd_hostname);
 	g_free(prefs.mpd_password);
 	g_free(prefs.as_username);
@@ -198,6 +323,10 @@ static gint parse_config_file(void)
 	prefs.cache_file = expand_tilde(cfg_getstr(cfg, "cache_file"));
 	prefs.queue_length = cfg_getint(cfg, "queue_length");
 	prefs.cache_interval = cfg_getint(cfg, "cache_interval");
+	prefs.metrics_socket = expand_tilde(cfg_getstr(cfg,
+				"metrics_socket"));
+	prefs.stall_threshold = cfg_getint(cfg, "stall_threshold");
+	prefs.trace_file = expand_tilde(cfg_getstr(cfg, "trace_file"));
 
 	sec_mpd = cfg_getsec(cfg, "mpd");
 	prefs.mpd_hostname = g_strdup(cfg_getstr(sec_mpd, "host"));
@@ -210,6 +339,22 @@ static gint parse_config_file(void)
 	prefs.as_username = g_strdup(cfg_getstr(sec_as, "username"));
 	prefs.as_password = g_strdup(cfg_getstr(sec_as, "password"));
 	prefs.as_password_hash = g_strdup(cfg_getstr(sec_as, "password_hash"));
+	prefs.as_batches = cfg_getint(sec_as, "batches");
+	prefs.as_batch_songs = cfg_getint(sec_as, "batch_songs");
+	prefs.as_batch_delay = cfg_getint(sec_as, "batch_delay");
+	prefs.as_now_playing_delay = cfg_getint(sec_as, "now_playing_delay");
+
+	g_strfreev(prefs.instances);
+	instances = cfg_size(cfg, "instance");
+	prefs.instances = g_new0(gchar *, instances + 1);
+	for (guint i = 0; i < instances; i++)
+		prefs.instances[i] = g_strdup(cfg_title(
+					cfg_getnsec(cfg, "instance", i)));
+
+	if (prefs.instance && apply_instance(cfg) < 0) {
+		cfg_free(cfg);
+		return -1;
+	}
 
 	prefs.fork = TRUE;
 
@@ -220,7 +365,7 @@ static gint parse_config_file(void)
 static gint parse_command_line(gint argc, gchar **argv)
 {
 	GError *error = NULL;
-	gchar *pid_file = NULL, *conf_file = NULL;
+	gchar *pid_file = NULL, *conf_file = NULL, *instance = NULL;
 	gboolean dokill = FALSE, debug = FALSE, quiet = FALSE, version = FALSE;
 	gboolean fork = TRUE;
 	GOptionEntry entries[] = {
@@ -240,6 +385,9 @@ static gint parse_command_line(gint argc, gchar **argv)
 		{ "foreground", 'n', G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE,
 			&fork, "Run the program in the foreground rather "
 				"than as a daemon.", NULL },
+		{ "instance", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_STRING,
+			&instance, "Run a single instance, used by the "
+				"supervisor.", "<name>" },
 		{ NULL, 0, 0, 0, NULL, NULL, NULL }
 	};
 
@@ -262,9 +410,12 @@ static gint parse_command_line(gint argc, gchar **argv)
 	}
 	/* This must be at the top, to avoid any options specified in the
 	 * config file overriding those on the command line. */
-	if (conf_file) {
-		g_free(prefs.config_file);
-		prefs.config_file = g_strdup(conf_file);
+	if (conf_file || instance) {
+		if (conf_file) {
+			g_free(prefs.config_file);
+			prefs.config_file = g_strdup(conf_file);
+		}
+		prefs.instance = g_strdup(instance);
 		if (parse_config_file() < 0)
 			return -1;
 	}
@@ -286,6 +437,7 @@ static gint parse_command_line(gint argc, gchar **argv)
 		kill_scmpc();
 	g_free(pid_file);
 	g_free(conf_file);
+	g_free(instance);
 	return 0;
 }
 
@@ -294,11 +446,17 @@ gint init_preferences(gint argc, gchar **argv)
 	gchar *tmp, *saveptr;
 
 	prefs.config_file = NULL;
+	prefs.instance = NULL;
+	prefs.instances = NULL;
 	if (parse_config_file() < 0)
 		return -1;
 	if (parse_command_line(argc, argv) < 0)
 		return -1;
 
+	// an instance has its own MPD server
+	if (prefs.instance)
+		return 0;
+
 	tmp = getenv("MPD_HOST");
 	if (tmp) {
 		g_free(prefs.mpd_password);
@@ -330,4 +488,8 @@ void clear_preferences(void)
 	g_free(prefs.as_username);
 	g_free(prefs.as_password);
 	g_free(prefs.as_password_hash);
+	g_free(prefs.metrics_socket);
+	g_free(prefs.trace_file);
+	g_free(prefs.instance);
+	g_strfreev(prefs.instances);
 }
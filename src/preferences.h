@@ -24,6 +24,9 @@
  */
 
 
+#ifndef HAVE_PREFERENCES_H
+#define HAVE_PREFERENCES_H
+
 #include <glib.h>
 
 struct {
@@ -40,10 +43,21 @@ struct {
 	gchar *as_username;
 	gchar *as_password;
 	gchar *as_password_hash;
+	gint as_batches;
+	gint as_batch_songs;
+	gint as_batch_delay;
+	gint as_now_playing_delay;
 	gchar *cache_file;
 	gint queue_length;
 	gint cache_interval;
+	gchar *metrics_socket;
+	gint stall_threshold;
+	gchar *trace_file;
+	gchar *instance;
+	gchar **instances;
 } prefs;
 
 gint init_preferences(gint argc, gchar *argv[]);
 void clear_preferences(void);
+
+#endif // HAVE_PREFERENCES_H
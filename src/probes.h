@@ -0,0 +1,55 @@
+/**
+ * probes.h: Static probes for systemtap, perf and bpftrace.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#ifndef HAVE_PROBES_H
+#define HAVE_PROBES_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* Probes are only compiled in with --enable-sdt. Each of them is a single
+ * nop then, until a tracer attaches to it, so only values which are at hand
+ * anyway should be passed to them. List them with "perf list sdt_scmpc:*" after
+ * "perf buildid-cache --add scmpc", or with "bpftrace -l usdt:scmpc:*". */
+#ifdef ENABLE_SDT
+#include <sys/sdt.h>
+
+#define PROBE(name) DTRACE_PROBE(scmpc, name)
+#define PROBE1(name, a) DTRACE_PROBE1(scmpc, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(scmpc, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(scmpc, name, a, b, c)
+#else
+// sizeof keeps the arguments from being unused without evaluating them
+#define PROBE(name) do {} while (0)
+#define PROBE1(name, a) do { (void)sizeof (a); } while (0)
+#define PROBE2(name, a, b) do { (void)sizeof (a); (void)sizeof (b); } \
+	while (0)
+#define PROBE3(name, a, b, c) do { (void)sizeof (a); (void)sizeof (b); \
+	(void)sizeof (c); } while (0)
+#endif
+
+#endif // HAVE_PROBES_H
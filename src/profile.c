@@ -0,0 +1,167 @@
+/**
+ * profile.c: Main loop dispatch profiling.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+
+#include "profile.h"
+#include "preferences.h"
+
+/* Every callback in scmpc runs in the same main loop, so one that takes
+ * long holds up all the others. Sources added through these functions have
+ * the time of every dispatch recorded in a histogram per callback, and
+ * dispatches longer than prefs.stall_threshold milliseconds are logged. */
+typedef struct {
+	const gchar *name;
+	GSourceFunc func;
+	GIOFunc io_func;
+	gpointer data;
+	metrics_histogram *histogram;
+} profile_callback;
+
+static GHashTable *histograms;
+
+static profile_callback *profile_callback_new(const gchar *name,
+		gpointer data)
+{
+	profile_callback *callback = g_new0(profile_callback, 1);
+
+	if (!histograms)
+		histograms = g_hash_table_new_full(g_str_hash, g_str_equal,
+				NULL, g_free);
+	callback->histogram = g_hash_table_lookup(histograms, name);
+	if (!callback->histogram) {
+		callback->histogram = g_new0(metrics_histogram, 1);
+		g_hash_table_insert(histograms, (gpointer)name,
+				callback->histogram);
+	}
+	callback->name = name;
+	callback->data = data;
+	return callback;
+}
+
+static void profile_callback_free(gpointer data)
+{
+	g_free(data);
+}
+
+static void profile_account(profile_callback *callback, gint64 start)
+{
+	gdouble seconds = metrics_observe(callback->histogram, start);
+
+	if (prefs.stall_threshold &&
+			seconds * 1000 >= prefs.stall_threshold)
+		g_message("Main loop stalled for %.0f ms in %s", seconds * 1000,
+				callback->name);
+}
+
+static gboolean profile_dispatch(gpointer data)
+{
+	profile_callback *callback = data;
+	gint64 start = g_get_monotonic_time();
+	gboolean ret = callback->func(callback->data);
+
+	profile_account(callback, start);
+	return ret;
+}
+
+static gboolean profile_io_dispatch(GIOChannel *channel,
+		GIOCondition condition, gpointer data)
+{
+	profile_callback *callback = data;
+	gint64 start = g_get_monotonic_time();
+	gboolean ret = callback->io_func(channel, condition, callback->data);
+
+	profile_account(callback, start);
+	return ret;
+}
+
+guint profile_io_add_watch_named(GIOChannel *channel, GIOCondition condition,
+		GIOFunc func, gpointer data, const gchar *name)
+{
+	profile_callback *callback = profile_callback_new(name, data);
+
+	callback->io_func = func;
+	return g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, condition,
+			profile_io_dispatch, callback, profile_callback_free);
+}
+
+guint profile_timeout_add_named(guint interval, gboolean seconds,
+		GSourceFunc func, gpointer data, const gchar *name)
+{
+	profile_callback *callback = profile_callback_new(name, data);
+
+	callback->func = func;
+	if (seconds)
+		return g_timeout_add_seconds_full(G_PRIORITY_DEFAULT, interval,
+				profile_dispatch, callback,
+				profile_callback_free);
+	return g_timeout_add_full(G_PRIORITY_DEFAULT, interval,
+			profile_dispatch, callback, profile_callback_free);
+}
+
+guint profile_idle_add_named(gint priority, GSourceFunc func, gpointer data,
+		const gchar *name)
+{
+	profile_callback *callback = profile_callback_new(name, data);
+
+	callback->func = func;
+	return g_idle_add_full(priority, profile_dispatch, callback,
+			profile_callback_free);
+}
+
+/* The source is created here, on the thread the callbacks are registered
+ * on, and can then be attached from another thread to wake up the main
+ * loop */
+GSource *profile_idle_source_new_named(gint priority, GSourceFunc func,
+		gpointer data, const gchar *name)
+{
+	profile_callback *callback = profile_callback_new(name, data);
+	GSource *source = g_idle_source_new();
+
+	callback->func = func;
+	g_source_set_priority(source, priority);
+	g_source_set_callback(source, profile_dispatch, callback,
+			profile_callback_free);
+	return source;
+}
+
+void profile_foreach(profile_func func, gpointer data)
+{
+	GHashTableIter iter;
+	gpointer name, histogram;
+
+	if (!histograms)
+		return;
+	g_hash_table_iter_init(&iter, histograms);
+	while (g_hash_table_iter_next(&iter, &name, &histogram))
+		func(name, histogram, data);
+}
+
+void profile_cleanup(void)
+{
+	if (histograms)
+		g_hash_table_destroy(histograms);
+	histograms = NULL;
+}
@@ -0,0 +1,63 @@
+/**
+ * profile.h: Main loop dispatch profiling.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+
+#ifndef HAVE_PROFILE_H
+#define HAVE_PROFILE_H
+
+#include <glib.h>
+
+#include "metrics.h"
+
+/* These add a source like their GLib counterparts, but time every dispatch
+ * of it under the name of the callback */
+#define profile_io_add_watch(channel, condition, func, data) \
+	profile_io_add_watch_named(channel, condition, func, data, #func)
+#define profile_timeout_add(interval, func, data) \
+	profile_timeout_add_named(interval, FALSE, func, data, #func)
+#define profile_timeout_add_seconds(interval, func, data) \
+	profile_timeout_add_named(interval, TRUE, func, data, #func)
+#define profile_idle_add(priority, func, data) \
+	profile_idle_add_named(priority, func, data, #func)
+#define profile_idle_source_new(priority, func, data) \
+	profile_idle_source_new_named(priority, func, data, #func)
+
+typedef void (*profile_func)(const gchar *name,
+		const metrics_histogram *histogram, gpointer data);
+
+guint profile_io_add_watch_named(GIOChannel *channel, GIOCondition condition,
+		GIOFunc func, gpointer data, const gchar *name);
+guint profile_timeout_add_named(guint interval, gboolean seconds,
+		GSourceFunc func, gpointer data, const gchar *name);
+guint profile_idle_add_named(gint priority, GSourceFunc func, gpointer data,
+		const gchar *name);
+GSource *profile_idle_source_new_named(gint priority, GSourceFunc func,
+		gpointer data, const gchar *name);
+
+void profile_foreach(profile_func func, gpointer data);
+void profile_cleanup(void);
+
+#endif // HAVE_PROFILE_H
@@ -25,72 +25,679 @@
 
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <mpd/client.h>
 
+#include "misc.h"
+#include "journal.h"
 #include "queue.h"
+#include "spill.h"
+#include "metrics.h"
 #include "preferences.h"
+#include "probes.h"
+#include "profile.h"
 #include "scmpc.h"
 #include "mpd.h"
+#include "trace.h"
 
-void queue_add(const gchar *artist, const gchar *title, const gchar *album,
-	guint length, const gchar *track, glong date)
+/* The cache file is a header followed by a fixed-size record for every
+ * song and a string table the records point into. Each string in the table
+ * is prefixed with its length and terminated with a NUL byte, so it can be
+ * used straight from the mapped file. Numbers are stored in host byte
+ * order. */
+#define CACHE_MAGIC "SCMPCQ\r\n"
+#define CACHE_VERSION 1
+#define CACHE_NULL G_MAXUINT32
+
+typedef struct {
+	gchar magic[8];
+	guint32 version;
+	guint32 count;
+	guint64 generation;
+	guint32 strings;
+	guint32 crc;
+} cache_header;
+
+typedef struct {
+	gint64 date;
+	guint32 length;
+	guint32 artist;
+	guint32 title;
+	guint32 album;
+	guint32 track;
+	guint32 reserved;
+} cache_record;
+
+/* The songs of the cache file which don't fit into the in-memory queue
+ * are left in its mapping, and paged in from there before the songs in the
+ * spill file, so loading a long backlog doesn't write it out again. The
+ * mapping stays valid when the file is replaced. */
+typedef struct {
+	gchar *data;
+	gsize size;
+	const cache_record *records;
+	const gchar *strings;
+	guint32 strings_size;
+	/* The songs from next up to count are still waiting in the file */
+	guint32 next;
+	guint32 count;
+	guint pinned;
+} cache_map;
+
+static cache_map mapped;
+
+/* Size at which the buffers of the cache writer are flushed */
+#define CACHE_BUFFER_SIZE 65536
+
+typedef struct {
+	gint fd;
+	GString *records;
+	GString *strings;
+	off_t records_pos;
+	off_t strings_pos;
+	guint32 strings_size;
+	guint32 count;
+	GHashTable *offsets;
+	gboolean failed;
+} cache_writer;
+
+/* The cache is written by a thread of its own, so a long queue doesn't
+ * stall the main loop. It works from a copy of the in-memory queue and
+ * the part of the spill file which was in use when the copy was taken,
+ * the spill file is kept from being truncated until it is done. */
+typedef struct {
+	gchar *artist;
+	gchar *title;
+	gchar *album;
+	gchar *track;
+	guint length;
+	glong date;
+} cache_song;
+
+typedef struct {
+	GArray *songs;
+	cache_map cached;
+	off_t spill_pos;
+	guint spill_count;
+	gchar *path;
+	guint64 generation;
+	gint64 start;
+	guint32 count;
+	gsize size;
+	gboolean saved;
+	GSource *done;
+} cache_snapshot;
+
+static GThread *cache_thread;
+static cache_snapshot *cache_pending;
+
+/* The in-memory queue is a ring of songs divided into segments. The titles
+ * of the songs in a segment are packed into its arena, which is freed as a
+ * whole once the last of them has been removed. */
+#define QUEUE_SEGMENT_SIZE 64
+#define QUEUE_ARENA_SIZE 4096
+
+typedef struct {
+	GStringChunk *strings;
+	guint live;
+	/* Size of the blocks allocated for the arena, and what is left of
+	 * the last one */
+	gsize bytes;
+	gsize left;
+} queue_segment;
+
+static queue_node *ring;
+static queue_segment *segments;
+static guint ring_size, ring_segments, head;
+
+/* Artist, album and track names repeat a lot in a backlog, so they are
+ * interned: every distinct string is stored once with a reference count */
+typedef struct {
+	guint refs;
+	gchar str[];
+} queue_string;
+
+static GHashTable *interned;
+static gsize interned_bytes;
+
+static guint compact_source, save_source;
+
+/* A cache write which failed is retried after this many seconds, doubling
+ * up to CACHE_RETRY_MAX while it keeps failing */
+#define CACHE_RETRY_MIN 60
+#define CACHE_RETRY_MAX 3600
+static guint cache_retry;
+
+static gboolean queue_write_cache(cache_snapshot *snapshot);
+static void queue_write_now(void);
+static void queue_check_save(void);
+static gboolean queue_save_timeout(gpointer data);
+
+static const gchar *cache_string(const gchar *strings, guint32 size,
+		guint32 offset, gboolean *valid)
 {
-	queue_node *new_song;
+	guint32 len;
 
-	if (!artist || !title || length < 30) {
-		g_debug("Invalid song passed to queue_add(). Rejecting.");
+	if (offset == CACHE_NULL)
+		return NULL;
+	if (offset > size || size - offset < sizeof len) {
+		*valid = FALSE;
+		return NULL;
+	}
+	memcpy(&len, strings + offset, sizeof len);
+	offset += sizeof len;
+	if (len >= size - offset || strings[offset + len] != '\0') {
+		*valid = FALSE;
+		return NULL;
+	}
+	return strings + offset;
+}
+
+/* Passes song i of a mapped cache file to func, returns FALSE if its
+ * strings are invalid */
+static gboolean cache_read(const cache_map *map, guint32 i, spill_func func,
+		gpointer data)
+{
+	const cache_record *r = &map->records[i];
+	const gchar *artist, *title, *album, *track;
+	gboolean valid = TRUE;
+
+	artist = cache_string(map->strings, map->strings_size, r->artist,
+			&valid);
+	title = cache_string(map->strings, map->strings_size, r->title,
+			&valid);
+	album = cache_string(map->strings, map->strings_size, r->album,
+			&valid);
+	track = cache_string(map->strings, map->strings_size, r->track,
+			&valid);
+	if (valid)
+		func(artist, title, album, r->length, track, r->date, data);
+	return valid;
+}
+
+/* Unmaps the cache file once all of its songs have been paged in */
+static void cache_unmap(void)
+{
+	if (!mapped.data || mapped.next < mapped.count || mapped.pinned)
 		return;
+	munmap(mapped.data, mapped.size);
+	memset(&mapped, 0, sizeof mapped);
+}
+
+guint queue_on_disk(void)
+{
+	return mapped.count - mapped.next + spill.count;
+}
+
+static void queue_ring_init(void)
+{
+	/* One spare segment, so the tail never has to wait for the segment
+	 * the head is in to drain before the queue is full */
+	ring_segments = (prefs.queue_length + QUEUE_SEGMENT_SIZE - 1) /
+		QUEUE_SEGMENT_SIZE + 1;
+	ring_size = ring_segments * QUEUE_SEGMENT_SIZE;
+	ring = g_new0(queue_node, ring_size);
+	segments = g_new0(queue_segment, ring_segments);
+	head = 0;
+}
+
+static gboolean queue_full(void)
+{
+	guint slot;
+
+	if (queue.length >= prefs.queue_length)
+		return TRUE;
+	if (!ring)
+		return FALSE;
+
+	/* A segment is only reused once all of its songs are gone, so its
+	 * arena can be freed in one go */
+	slot = (head + queue.length) % ring_size;
+	return slot % QUEUE_SEGMENT_SIZE == 0 &&
+		segments[slot / QUEUE_SEGMENT_SIZE].live > 0;
+}
+
+static gchar *queue_strdup(queue_segment *segment, const gchar *str)
+{
+	gsize len;
+
+	if (!str)
+		return NULL;
+
+	/* The arena grows the way GStringChunk does: a new block of at least
+	 * QUEUE_ARENA_SIZE bytes whenever a string doesn't fit the last one */
+	len = strlen(str) + 1;
+	if (len > segment->left) {
+		segment->left = QUEUE_ARENA_SIZE;
+		while (segment->left < len)
+			segment->left <<= 1;
+		segment->bytes += segment->left;
+	}
+	segment->left -= len;
+	return g_string_chunk_insert(segment->strings, str);
+}
+
+static gchar *queue_intern(const gchar *str)
+{
+	queue_string *entry;
+	gsize len;
+
+	if (!str)
+		return NULL;
+	if (!interned)
+		interned = g_hash_table_new_full(g_str_hash, g_str_equal,
+				NULL, g_free);
+
+	entry = g_hash_table_lookup(interned, str);
+	if (!entry) {
+		len = strlen(str) + 1;
+		entry = g_malloc(sizeof *entry + len);
+		entry->refs = 0;
+		memcpy(entry->str, str, len);
+		g_hash_table_insert(interned, entry->str, entry);
+		interned_bytes += sizeof *entry + len;
 	}
+	entry->refs++;
+	return entry->str;
+}
 
-	new_song = g_malloc(sizeof (queue_node));
-	if (!new_song)
+static void queue_unintern(const gchar *str)
+{
+	queue_string *entry;
+
+	if (!str || !(entry = g_hash_table_lookup(interned, str)))
 		return;
+	if (!--entry->refs) {
+		interned_bytes -= sizeof *entry + strlen(entry->str) + 1;
+		g_hash_table_remove(interned, entry->str);
+	}
+}
 
-	new_song->title = g_strdup(title);
-	new_song->artist = g_strdup(artist);
-	if (album)
-		new_song->album = g_strdup(album);
-	else
-		new_song->album = g_strdup("");
+/* Songs are URL-encoded once when they are queued, not every time they are
+ * submitted. Encoded titles go into the arena, everything else is interned
+ * as well. */
+static gchar *queue_escape(queue_segment *segment, const gchar *str)
+{
+	gchar *escaped, *ret;
+
+	if (!str)
+		return NULL;
+	escaped = g_uri_escape_string(str, NULL, FALSE);
+	ret = segment ? queue_strdup(segment, escaped) : queue_intern(escaped);
+	g_free(escaped);
+	return ret;
+}
+
+static queue_node *queue_append(const gchar *artist, const gchar *title,
+		const gchar *album, guint length, const gchar *track,
+		glong date)
+{
+	queue_segment *segment;
+	queue_node *new_song;
+	guint slot;
+
+	if (!ring)
+		queue_ring_init();
+
+	slot = (head + queue.length) % ring_size;
+	segment = &segments[slot / QUEUE_SEGMENT_SIZE];
+	if (!segment->strings)
+		segment->strings = g_string_chunk_new(QUEUE_ARENA_SIZE);
+	segment->live++;
+
+	new_song = &ring[slot];
+	new_song->title = queue_strdup(segment, title);
+	new_song->artist = queue_intern(artist);
+	new_song->album = queue_intern(album ? album : "");
 	new_song->length = length;
-	new_song->track = g_strdup(track);
-	new_song->next = NULL;
-	if (!date)
-		new_song->date = time(NULL);
-	else
-		new_song->date = date;
+	new_song->track = queue_intern(track);
+	new_song->title_url = queue_escape(segment, new_song->title);
+	new_song->artist_url = queue_escape(NULL, new_song->artist);
+	new_song->album_url = queue_escape(NULL, new_song->album);
+	new_song->track_url = queue_escape(NULL, new_song->track);
+	new_song->date = date;
+	new_song->finished = 0;
+	new_song->trace = 0;
 	new_song->finished_playing = FALSE;
 
-	/* Queue is empty */
-	if (!queue.first) {
-		queue.first = queue.last = new_song;
-		queue.length = 1;
-		g_debug("Song added to queue. Queue length: 1");
-		return;
+	if (!queue.first)
+		queue.first = new_song;
+	queue.last = new_song;
+	queue.length++;
+	return new_song;
+}
+
+queue_node *queue_next(const queue_node *song)
+{
+	if (!song || song == queue.last)
+		return NULL;
+	return &ring[(song - ring + 1) % ring_size];
+}
+
+gsize queue_bytes(void)
+{
+	gsize bytes = ring_size * sizeof (queue_node) +
+		ring_segments * sizeof (queue_segment) + interned_bytes;
+
+	for (guint i = 0; i < ring_segments; i++)
+		bytes += segments[i].bytes;
+	return bytes;
+}
+
+/* Songs can only be removed from the front of the queue */
+static guint queue_free_songs(queue_node *song, queue_node *keep_ptr)
+{
+	queue_segment *segment;
+	guint count = 0;
+
+	if (song != queue.first)
+		return 0;
+
+	while (queue.length && queue.first != keep_ptr) {
+		queue_unintern(queue.first->artist);
+		queue_unintern(queue.first->album);
+		queue_unintern(queue.first->track);
+		queue_unintern(queue.first->artist_url);
+		queue_unintern(queue.first->album_url);
+		queue_unintern(queue.first->track_url);
+		segment = &segments[head / QUEUE_SEGMENT_SIZE];
+		if (!--segment->live) {
+			g_string_chunk_free(segment->strings);
+			segment->strings = NULL;
+			segment->bytes = segment->left = 0;
+		}
+		head = (head + 1) % ring_size;
+		queue.length--;
+		queue.first = queue.length ? &ring[head] : NULL;
+		count++;
 	}
 
-	/* Queue is full, remove the first item and add the new one */
-	if (queue.length == prefs.queue_length) {
-		queue_node *new_first_song = queue.first->next;
-		if (!new_first_song) {
-			g_debug("Queue is too long, but there is only one "
-					"accessible song in the list. New "
-					"song not added.");
-			return;
+	if (!queue.length)
+		queue.last = NULL;
+	return count;
+}
+
+/* Read songs back from the spill file until the in-memory queue is full */
+static void queue_page_in(const gchar *artist, const gchar *title,
+		const gchar *album, guint length, const gchar *track,
+		glong date, G_GNUC_UNUSED gpointer data)
+{
+	queue_node *song = queue_append(artist, title, album, length, track,
+			date);
+
+	/* Only the song which was added last can still be playing */
+	song->finished_playing = spill.count > 1 || queue.last_finished;
+}
+
+/* The same for the songs left in the cache file, which come first */
+static void queue_page_cached(const gchar *artist, const gchar *title,
+		const gchar *album, guint length, const gchar *track,
+		glong date, G_GNUC_UNUSED gpointer data)
+{
+	if (artist && title && length >= 30)
+		queue_append(artist, title, album, length, track,
+				date)->finished_playing = TRUE;
+}
+
+static void queue_refill(void)
+{
+	while (mapped.next < mapped.count && !queue_full()) {
+		if (!cache_read(&mapped, mapped.next++, queue_page_cached,
+					NULL)) {
+			g_warning("Cache file contains invalid strings, some "
+					"songs were not loaded.");
+			mapped.next = mapped.count;
 		}
-		queue_remove_songs(queue.first, new_first_song);
-		queue.first = new_first_song;
-		g_message("The queue of songs to be submitted is too long."
-				"The oldest song has been removed.");
 	}
-	queue.last->next = new_song;
-	queue.last = new_song;
-	queue.length++;
-	g_debug("Song added to queue. Queue length: %d", queue.length);
+	cache_unmap();
+
+	while (spill.count && !queue_full()) {
+		if (!spill_pop(queue_page_in, NULL))
+			break;
+	}
+}
+
+/* Returns FALSE if the song couldn't be stored, otherwise sets *song to it
+ * if it is in memory or to NULL if it went to the spill file */
+static gboolean queue_store(const gchar *artist, const gchar *title,
+		const gchar *album, guint length, const gchar *track,
+		glong date, queue_node **song)
+{
+	*song = NULL;
+
+	/* Once songs have been spilled to disk, newer ones have to go there
+	 * as well to keep the queue in order. If that fails the song is
+	 * refused, the ones already queued are never dropped for it. */
+	if (queue_on_disk() || queue_full()) {
+		if (spill_push(artist, title, album, length, track, date))
+			return TRUE;
+		g_warning("Queue is full, not queueing %s - %s.", artist,
+				title);
+		return FALSE;
+	}
+	*song = queue_append(artist, title, album, length, track, date);
+	return TRUE;
+}
+
+static cache_snapshot *cache_snapshot_new(void)
+{
+	cache_snapshot *snapshot = g_new0(cache_snapshot, 1);
+	queue_node *song;
+	cache_song copy;
+
+	snapshot->songs = g_array_sized_new(FALSE, FALSE, sizeof copy,
+			queue.length);
+	for (song = queue.first; song; song = queue_next(song)) {
+		copy.artist = g_strdup(song->artist);
+		copy.title = g_strdup(song->title);
+		copy.album = g_strdup(song->album);
+		copy.track = g_strdup(song->track);
+		copy.length = song->length;
+		copy.date = song->date;
+		g_array_append_val(snapshot->songs, copy);
+	}
+	snapshot->cached = mapped;
+	mapped.pinned++;
+	snapshot->spill_pos = spill.read_pos;
+	snapshot->spill_count = spill.count;
+	spill_pin();
+
+	snapshot->path = g_strdup(prefs.cache_file);
+	snapshot->generation = journal_mark();
+	snapshot->start = g_get_monotonic_time();
+	return snapshot;
+}
+
+static void cache_snapshot_free(cache_snapshot *snapshot)
+{
+	for (guint i = 0; i < snapshot->songs->len; i++) {
+		cache_song *song = &g_array_index(snapshot->songs,
+				cache_song, i);
+		g_free(song->artist); g_free(song->title);
+		g_free(song->album); g_free(song->track);
+	}
+	g_array_free(snapshot->songs, TRUE);
+	g_free(snapshot->path);
+	g_free(snapshot);
+}
+
+/* Back on the main thread once the cache has been written */
+static void cache_snapshot_finish(cache_snapshot *snapshot)
+{
+	mapped.pinned--;
+	cache_unmap();
+	spill_unpin();
+	if (snapshot->saved) {
+		PROBE2(queue_save, snapshot->count, snapshot->size);
+		journal_rebase(snapshot->generation);
+		metrics_observe(&metrics.cache_write, snapshot->start);
+		g_debug("Cache saved.");
+	}
+	cache_snapshot_free(snapshot);
+}
+
+static gpointer cache_thread_run(gpointer data)
+{
+	cache_snapshot *snapshot = data;
+
+	snapshot->saved = queue_write_cache(snapshot);
+	g_source_attach(snapshot->done, NULL);
+	return NULL;
+}
+
+static gboolean queue_cache_written(G_GNUC_UNUSED gpointer data)
+{
+	cache_snapshot *snapshot = cache_pending;
+
+	g_thread_join(cache_thread);
+	cache_thread = NULL;
+	cache_pending = NULL;
+	g_source_unref(snapshot->done);
+	if (!snapshot->saved) {
+		/* The journal is as long as it was, compacting it right
+		 * away would only fail again */
+		cache_retry = cache_retry ? MIN(cache_retry * 2,
+				CACHE_RETRY_MAX) : CACHE_RETRY_MIN;
+		g_message("Retrying to write the cache in %u seconds.",
+				cache_retry);
+		if (compact_source) {
+			g_source_remove(compact_source);
+			compact_source = 0;
+		}
+		if (save_source)
+			g_source_remove(save_source);
+		save_source = profile_timeout_add_seconds(cache_retry,
+				queue_save_timeout, NULL);
+	} else {
+		cache_retry = 0;
+	}
+	cache_snapshot_finish(snapshot);
+	queue_check_save();
+	return FALSE;
+}
+
+/* Waits for a cache write which is still running, for when the queue has
+ * to be saved right away */
+static void queue_join_save(void)
+{
+	cache_snapshot *snapshot = cache_pending;
+
+	if (!cache_thread)
+		return;
+	g_thread_join(cache_thread);
+	cache_thread = NULL;
+	cache_pending = NULL;
+	g_source_destroy(snapshot->done);
+	g_source_unref(snapshot->done);
+	cache_snapshot_finish(snapshot);
+}
+
+static void queue_start_save(void)
+{
+	if (save_source) {
+		g_source_remove(save_source);
+		save_source = 0;
+	}
+	if (cache_thread || !journal.records)
+		return;
+
+	cache_pending = cache_snapshot_new();
+	cache_pending->done = profile_idle_source_new(G_PRIORITY_DEFAULT,
+			queue_cache_written, NULL);
+	cache_thread = g_thread_new("cache", cache_thread_run, cache_pending);
+}
+
+static gboolean queue_compact(G_GNUC_UNUSED gpointer data)
+{
+	compact_source = 0;
+	g_debug("Compacting journal (%u of %u records obsolete).",
+			journal.dead, journal.records);
+	queue_start_save();
+	return FALSE;
+}
+
+static gboolean queue_save_timeout(G_GNUC_UNUSED gpointer data)
+{
+	save_source = 0;
+	queue_start_save();
+	return FALSE;
+}
+
+/* Called after every change to the queue. The cache is only written once
+ * cache_interval has passed since the first change it doesn't contain, so
+ * nothing wakes up while the queue stays the same. The journal is also
+ * compacted once it has grown long compared to the queue, which is what
+ * happens while songs can't be submitted. */
+static void queue_check_save(void)
+{
+	/* Nothing else is scheduled while a failed write waits for its
+	 * retry */
+	if (cache_thread || (cache_retry && save_source))
+		return;
+	if ((journal.dead >= JOURNAL_COMPACT_THRESHOLD ||
+			journal.records >= MAX(JOURNAL_MAX_RECORDS,
+				queue.length + queue_on_disk())) &&
+			!compact_source)
+		compact_source = profile_idle_add(G_PRIORITY_LOW,
+				queue_compact, NULL);
+	if (prefs.cache_interval && journal.records && !save_source)
+		save_source = profile_timeout_add_seconds(
+				prefs.cache_interval * 60, queue_save_timeout,
+				NULL);
+}
+
+void queue_add(const gchar *artist, const gchar *title, const gchar *album,
+	guint length, const gchar *track, glong date, guint trace)
+{
+	queue_node *song;
+
+	if (!artist || !title || length < 30) {
+		g_debug("Invalid song passed to queue_add(). Rejecting.");
+		trace_scrobble('e', "scrobble", trace, "result", "invalid",
+				NULL);
+		return;
+	}
+
+	if (!date)
+		date = time(NULL);
+
+	if (!queue_store(artist, title, album, length, track, date, &song)) {
+		trace_scrobble('e', "scrobble", trace, "result", "refused",
+				NULL);
+		return;
+	}
+	queue.last_finished = FALSE;
+	journal_add(artist, title, album, length, track, date);
+	queue_check_save();
+	PROBE2(queue_add, date, queue.length + queue_on_disk());
+
+	/* The trace follows the song while it is in memory, songs in the
+	 * spill file don't keep their id */
+	if (song) {
+		song->trace = trace;
+		trace_scrobble('n', "queued", trace, NULL);
+	} else {
+		trace_scrobble('e', "scrobble", trace, "result", "spilled",
+				NULL);
+	}
+	g_debug("Song added to queue. Queue length: %d (%u on disk)",
+			queue.length + queue_on_disk(), queue_on_disk());
+}
+
+void queue_finish_last(void)
+{
+	if (queue.last && !queue.last->finished_playing) {
+		queue.last->finished_playing = TRUE;
+		queue.last->finished = time(NULL);
+	}
+	queue.last_finished = TRUE;
 }
 
 void queue_add_current_song(void)
@@ -100,32 +707,64 @@ void queue_add_current_song(void)
 			mpd_song_get_tag(mpd.song, MPD_TAG_ALBUM, 0),
 			mpd_song_get_duration(mpd.song),
 			mpd_song_get_tag(mpd.song, MPD_TAG_TRACK, 0),
-			mpd.song_date);
+			mpd.song_date, mpd.song_trace);
 	mpd.song_submitted = TRUE;
+	mpd.song_trace = 0;
 }
 
-void queue_load(void)
+static void queue_load_song(const gchar *artist, const gchar *title,
+		const gchar *album, guint length, const gchar *track,
+		glong date)
+{
+	queue_node *song;
+
+	if (!artist || !title || length < 30)
+		return;
+
+	if (queue_store(artist, title, album, length, track, date, &song) &&
+			song)
+		song->finished_playing = TRUE;
+}
+
+static void queue_load_remove(guint count)
+{
+	while (count && queue.first) {
+		queue_node *keep = queue.first;
+		guint n = 0;
+
+		while (keep && n < count) {
+			keep = queue_next(keep);
+			n++;
+		}
+		queue_free_songs(queue.first, keep);
+		queue_refill();
+		count -= n;
+	}
+}
+
+/* Parse the text cache written by scmpc 0.4 and earlier. Lines can be of
+ * any length, and the last one doesn't need a newline. */
+static guint64 queue_load_text(const gchar *data, gsize size)
 {
-	gchar line[256], *artist, *album, *title, *track;
+	const gchar *end = data + size, *eol;
+	gchar *line, *artist, *album, *title, *track;
 	guint length = 0;
-	FILE *cache_file;
 	glong date = 0;
+	guint64 generation = 0;
 
 	artist = title = album = track = NULL;
-	g_debug("Loading queue.");
 
-	cache_file = fopen(prefs.cache_file, "r");
-	if (!cache_file) {
-		if (errno != ENOENT)
-			g_message("Failed to open cache file for reading: %s",
-				g_strerror(errno));
-		return;
-	}
+	for (; data < end; data = eol + 1) {
+		eol = memchr(data, '\n', end - data);
+		if (!eol)
+			eol = end;
+		line = g_strndup(data, eol - data);
 
-	while (fgets(line, sizeof line, cache_file)) {
-		*strrchr(line, '\n') = 0;
-		if (!strncmp(line, "# BEGIN SONG", 12)) {
+		if (!strncmp(line, "# GENERATION ", 13)) {
+			generation = g_ascii_strtoull(&line[13], NULL, 10);
+		} else if (!strncmp(line, "# BEGIN SONG", 12)) {
 			g_free(artist); g_free(title); g_free(album);
+			g_free(track);
 			artist = title = album = track = NULL;
 			length = 0;
 		} else if (!strncmp(line, "artist: ", 8)) {
@@ -145,65 +784,331 @@ void queue_load(void)
 			g_free(track);
 			track = g_strdup(&line[7]);
 		} else if (!strncmp(line, "# END SONG", 10)) {
-			queue_add(artist, title, album, length, track, date);
-			queue.last->finished_playing = TRUE;
+			queue_load_song(artist, title, album, length, track,
+					date);
 			g_free(artist); g_free(title); g_free(album);
 			g_free(track);
 			artist = title = album = track = NULL;
 		}
+		g_free(line);
 	}
 	g_free(artist); g_free(title); g_free(album); g_free(track);
-	fclose(cache_file);
+	return generation;
+}
+
+static gboolean queue_load_binary(gchar *data, gsize size,
+		guint64 *generation)
+{
+	const cache_header *header = (const cache_header *)data;
+	const cache_record *records;
+
+	if (size < sizeof *header || header->version != CACHE_VERSION ||
+			(size - sizeof *header) / sizeof *records <
+				header->count ||
+			size - sizeof *header - header->count *
+				sizeof *records != header->strings) {
+		g_warning("Cache file is damaged.");
+		return FALSE;
+	}
+	if (crc32_checksum(data + sizeof *header, size - sizeof *header) !=
+			header->crc) {
+		g_warning("Cache file checksum mismatch.");
+		return FALSE;
+	}
+
+	/* The songs are paged in from the mapping, which is kept until the
+	 * last of them is in memory */
+	records = (const cache_record *)(data + sizeof *header);
+	mapped.data = data;
+	mapped.size = size;
+	mapped.records = records;
+	mapped.strings = (const gchar *)(records + header->count);
+	mapped.strings_size = header->strings;
+	mapped.next = 0;
+	mapped.count = header->count;
+
+	*generation = header->generation;
+	return TRUE;
+}
+
+/* A cache file which couldn't be read is moved aside together with the
+ * journal, which only makes sense on top of it, so that neither of them is
+ * overwritten when the queue is saved next. If that fails, both are left
+ * alone and nothing is saved. */
+static void queue_set_aside(void)
+{
+	if (file_set_aside(prefs.cache_file) && journal_set_aside()) {
+		g_warning("Starting with an empty queue, the old one was "
+				"moved to %s.damaged.", prefs.cache_file);
+		return;
+	}
+	g_warning("The queue won't be saved until %s and its journal have "
+			"been moved away.", prefs.cache_file);
+}
+
+void queue_load(void)
+{
+	struct stat st;
+	gchar *data;
+	gint fd;
+	guint64 generation = 0;
+	gboolean migrate = FALSE, damaged = FALSE;
+	gsize loaded = 0;
+
+	g_debug("Loading queue.");
+
+	spill_open();
+	fd = open(prefs.cache_file, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			g_message("Failed to open cache file for reading: %s",
+				g_strerror(errno));
+			damaged = TRUE;
+		}
+	} else if (fstat(fd, &st) < 0) {
+		g_message("Failed to read cache file: %s", g_strerror(errno));
+		damaged = TRUE;
+	} else if (st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			g_message("Failed to map cache file: %s",
+					g_strerror(errno));
+			damaged = TRUE;
+		} else if ((gsize)st.st_size >= sizeof CACHE_MAGIC - 1 &&
+				!memcmp(data, CACHE_MAGIC,
+					sizeof CACHE_MAGIC - 1)) {
+			damaged = !queue_load_binary(data, st.st_size,
+					&generation);
+		} else {
+			g_message("Converting cache file to the new format.");
+			generation = queue_load_text(data, st.st_size);
+			migrate = TRUE;
+		}
+		if (data != MAP_FAILED) {
+			if (data != mapped.data)
+				munmap(data, st.st_size);
+			loaded = st.st_size;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	queue_refill();
+
+	/* Apply everything that happened after the cache was written. Which
+	 * part of the journal that is can't be told without the cache. */
+	if (damaged)
+		queue_set_aside();
+	else
+		journal_replay(generation, queue_load_song,
+				queue_load_remove);
+	queue.last_finished = TRUE;
+	PROBE2(queue_load, queue.length + queue_on_disk(), loaded);
+	metrics_ready(READY_QUEUE);
+	g_debug("Queue loaded. Queue length: %d (%u on disk), %lu bytes in "
+			"memory", queue.length + queue_on_disk(),
+			queue_on_disk(), (gulong)queue_bytes());
+
+	if (migrate)
+		queue_write_now();
+	else
+		queue_check_save();
 }
 
 void queue_remove_songs(queue_node *song, queue_node *keep_ptr)
 {
-	queue_node *next_song;
+	guint count = queue_free_songs(song, keep_ptr);
 
-	while (song && song != keep_ptr) {
-		g_free(song->title);
-		g_free(song->artist);
-		g_free(song->album);
-		g_free(song->track);
-		next_song = song->next;
-		g_free(song);
-		song = next_song;
-		queue.length--;
+	if (count) {
+		journal_remove(count);
+		queue_refill();
+		queue_check_save();
+		PROBE2(queue_remove, count, queue.length + queue_on_disk());
 	}
+}
 
-	if (!queue.length)
-		queue.first = queue.last = NULL;
+static void cache_flush(cache_writer *writer, GString *buffer, off_t *pos)
+{
+	if (!writer->failed && buffer->len && pwrite(writer->fd, buffer->str,
+				buffer->len, *pos) != (gssize)buffer->len)
+		writer->failed = TRUE;
+	*pos += buffer->len;
+	g_string_truncate(buffer, 0);
 }
 
-gboolean queue_save(G_GNUC_UNUSED gpointer data)
+static guint32 cache_add_string(cache_writer *writer, const gchar *str,
+		gboolean shared)
+{
+	gpointer offset;
+	guint32 len;
+
+	if (!str)
+		return CACHE_NULL;
+
+	/* Most songs share their artist and album with others, so those
+	 * are only stored once */
+	if (shared && g_hash_table_lookup_extended(writer->offsets, str, NULL,
+				&offset))
+		return GPOINTER_TO_UINT(offset);
+
+	offset = GUINT_TO_POINTER(writer->strings_size);
+	len = strlen(str);
+	g_string_append_len(writer->strings, (gchar *)&len, sizeof len);
+	g_string_append_len(writer->strings, str, len + 1);
+	writer->strings_size += sizeof len + len + 1;
+	if (shared)
+		g_hash_table_insert(writer->offsets, g_strdup(str), offset);
+
+	if (writer->strings->len >= CACHE_BUFFER_SIZE)
+		cache_flush(writer, writer->strings, &writer->strings_pos);
+	return GPOINTER_TO_UINT(offset);
+}
+
+static void cache_add_song(const gchar *artist, const gchar *title,
+		const gchar *album, guint length, const gchar *track,
+		glong date, gpointer data)
 {
-	FILE *cache_file;
-	queue_node *current_song;
+	cache_writer *writer = data;
+	cache_record record;
+
+	memset(&record, 0, sizeof record);
+	record.date = date;
+	record.length = length;
+	record.artist = cache_add_string(writer, artist, TRUE);
+	record.title = cache_add_string(writer, title, FALSE);
+	record.album = cache_add_string(writer, album, TRUE);
+	record.track = cache_add_string(writer, track, TRUE);
+	g_string_append_len(writer->records, (gchar *)&record, sizeof record);
+	writer->count++;
 
-	current_song = queue.first;
+	if (writer->records->len >= CACHE_BUFFER_SIZE)
+		cache_flush(writer, writer->records, &writer->records_pos);
+}
+
+/* The cache is written in one pass with bounded memory: the records and the
+ * string table are buffered separately and flushed to their own regions of
+ * the file, the checksum is computed from the finished file. This runs in
+ * the cache thread and only touches the snapshot. */
+static gboolean queue_write_cache(cache_snapshot *snapshot)
+{
+	cache_header header;
+	cache_writer writer;
+	gchar *tmp_file, *data;
+	const cache_map *cached = &snapshot->cached;
+	guint32 count = snapshot->songs->len + cached->count - cached->next +
+		snapshot->spill_count;
+	gsize size;
 
-	cache_file = fopen(prefs.cache_file, "w");
-	if (!cache_file) {
+	tmp_file = g_strconcat(snapshot->path, ".tmp", NULL);
+	writer.fd = open(tmp_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (writer.fd < 0) {
 		g_warning("Failed to open cache file for writing: %s",
 			g_strerror(errno));
+		g_free(tmp_file);
+		return FALSE;
+	}
+
+	writer.records = g_string_sized_new(CACHE_BUFFER_SIZE);
+	writer.strings = g_string_sized_new(CACHE_BUFFER_SIZE);
+	writer.records_pos = sizeof header;
+	writer.strings_pos = sizeof header + count * sizeof (cache_record);
+	writer.strings_size = writer.count = 0;
+	writer.offsets = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+	writer.failed = FALSE;
+
+	for (guint i = 0; i < snapshot->songs->len; i++) {
+		cache_song *song = &g_array_index(snapshot->songs,
+				cache_song, i);
+		cache_add_song(song->artist, song->title, song->album,
+				song->length, song->track, song->date, &writer);
+	}
+	for (guint32 i = cached->next; i < cached->count; i++)
+		if (!cache_read(cached, i, cache_add_song, &writer))
+			break;
+	spill_foreach_from(snapshot->spill_pos, snapshot->spill_count,
+			cache_add_song, &writer);
+
+	cache_flush(&writer, writer.records, &writer.records_pos);
+	cache_flush(&writer, writer.strings, &writer.strings_pos);
+	g_string_free(writer.records, TRUE);
+	g_string_free(writer.strings, TRUE);
+	g_hash_table_destroy(writer.offsets);
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, CACHE_MAGIC, sizeof header.magic);
+	header.version = CACHE_VERSION;
+	header.count = writer.count;
+	header.generation = snapshot->generation;
+	header.strings = writer.strings_size;
+
+	size = writer.strings_pos;
+	data = MAP_FAILED;
+	if (!writer.failed && writer.count == count)
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, writer.fd, 0);
+	if (data != MAP_FAILED) {
+		header.crc = crc32_checksum(data + sizeof header,
+				size - sizeof header);
+		munmap(data, size);
+	}
+
+	/* The cache has to be on disk before the journal is cut down */
+	if (data == MAP_FAILED ||
+			pwrite(writer.fd, &header, sizeof header, 0) !=
+				sizeof header ||
+			fsync(writer.fd) < 0) {
+		g_warning("Failed to write cache file: %s",
+				g_strerror(errno));
+		close(writer.fd);
+		unlink(tmp_file);
+		g_free(tmp_file);
+		return FALSE;
+	}
+	/* The descriptor is gone even if close() fails, closing it again
+	 * could hit one the main thread has just opened */
+	if (close(writer.fd) < 0) {
+		g_warning("Failed to close cache file: %s",
+				g_strerror(errno));
+		unlink(tmp_file);
+		g_free(tmp_file);
 		return FALSE;
 	}
 
-	while (current_song) {
-		fprintf(cache_file, "# BEGIN SONG\n"
-			"artist: %s\n"
-			"title: %s\n"
-			"album: %s\n"
-			"length: %d\n"
-			"track: %s\n"
-			"date: %ld\n"
-			"# END SONG\n\n", current_song->artist,
-			current_song->title, current_song->album,
-			current_song->length, current_song->track,
-			(long)current_song->date);
-		current_song = current_song->next;
-	}
-	fclose(cache_file);
-	g_debug("Cache saved.");
+	if (rename(tmp_file, snapshot->path) < 0) {
+		g_warning("Failed to replace cache file: %s",
+				g_strerror(errno));
+		unlink(tmp_file);
+		g_free(tmp_file);
+		return FALSE;
+	}
+	g_free(tmp_file);
+
+	snapshot->count = writer.count;
+	snapshot->size = size;
+	return TRUE;
+}
+
+static void queue_write_now(void)
+{
+	cache_snapshot *snapshot;
+
+	if (save_source) {
+		g_source_remove(save_source);
+		save_source = 0;
+	}
+	queue_join_save();
+
+	snapshot = cache_snapshot_new();
+	snapshot->saved = queue_write_cache(snapshot);
+	cache_snapshot_finish(snapshot);
+}
+
+/* Writes the cache right away, on shutdown */
+gboolean queue_save(G_GNUC_UNUSED gpointer data)
+{
+	/* Everything is in the journal already, writing the cache only
+	 * serves to keep the journal short */
+	queue_join_save();
+	if (journal.records)
+		queue_write_now();
 	return TRUE;
 }
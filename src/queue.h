@@ -26,26 +26,41 @@
 
 #include <glib.h>
 
-typedef struct _queue_node {
+typedef struct {
 	gboolean finished_playing;
 	gchar *album;
 	gchar *artist;
 	gchar *title;
 	glong date;
+	/* When the song stopped playing, 0 if that isn't known */
+	glong finished;
+	/* The id of its scrobble in the trace, 0 if there is none */
+	guint trace;
 	guint length;
 	gchar *track;
-	struct _queue_node *next;
+	/* URL-encoded copies of the strings above */
+	gchar *album_url;
+	gchar *artist_url;
+	gchar *title_url;
+	gchar *track_url;
 } queue_node;
 
+/* Only the first prefs.queue_length songs are kept in memory, the rest
+ * waits in the cache file it was loaded from or in the spill file */
 struct {
 	queue_node *first;
 	queue_node *last;
 	gint length;
+	gboolean last_finished;
 } queue;
 
 void queue_add(const gchar *artist, const gchar *title, const gchar *album,
-	guint length, const gchar *track, glong date);
+	guint length, const gchar *track, glong date, guint trace);
 void queue_add_current_song(void);
+void queue_finish_last(void);
 void queue_load(void);
 void queue_remove_songs(queue_node *song, queue_node *keep_ptr);
+queue_node *queue_next(const queue_node *song);
+gsize queue_bytes(void);
+guint queue_on_disk(void);
 gboolean queue_save(gpointer data);
@@ -0,0 +1,90 @@
+/**
+ * retry.c: Request rate limiting and retry backoff.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#include "retry.h"
+
+static void token_bucket_refill(token_bucket *bucket)
+{
+	gint64 now = g_get_monotonic_time();
+
+	bucket->tokens += (now - bucket->updated) * bucket->rate /
+		G_USEC_PER_SEC;
+	if (bucket->tokens > bucket->capacity)
+		bucket->tokens = bucket->capacity;
+	bucket->updated = now;
+}
+
+void token_bucket_init(token_bucket *bucket, gdouble capacity, gdouble rate)
+{
+	bucket->tokens = bucket->capacity = capacity;
+	bucket->rate = rate;
+	bucket->updated = g_get_monotonic_time();
+}
+
+/* Take a token if at least reserve tokens are left afterwards */
+gboolean token_bucket_take(token_bucket *bucket, gdouble reserve)
+{
+	token_bucket_refill(bucket);
+	if (bucket->tokens < 1 + reserve)
+		return FALSE;
+	bucket->tokens--;
+	return TRUE;
+}
+
+/* Milliseconds until a token can be taken with reserve tokens left */
+guint token_bucket_wait(token_bucket *bucket, gdouble reserve)
+{
+	token_bucket_refill(bucket);
+	if (bucket->tokens >= 1 + reserve)
+		return 0;
+	return (1 + reserve - bucket->tokens) * 1000 / bucket->rate + 1;
+}
+
+void token_bucket_drain(token_bucket *bucket)
+{
+	bucket->tokens = 0;
+	bucket->updated = g_get_monotonic_time();
+}
+
+/* The delay doubles with every attempt. Half of it is random, so clients
+ * which failed together don't all come back at the same time. */
+guint backoff_next(backoff *policy)
+{
+	guint delay = policy->base;
+
+	for (guint i = 0; i < policy->attempts && delay < policy->max; i++)
+		delay *= 2;
+	if (delay > policy->max)
+		delay = policy->max;
+	policy->attempts++;
+
+	return delay / 2 + g_random_int_range(0, delay / 2 + 1);
+}
+
+void backoff_reset(backoff *policy)
+{
+	policy->attempts = 0;
+}
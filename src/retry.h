@@ -0,0 +1,56 @@
+/**
+ * retry.h: Request rate limiting and retry backoff.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#ifndef HAVE_RETRY_H
+#define HAVE_RETRY_H
+
+#include <glib.h>
+
+/* Allows bursts of up to capacity requests, refilled at rate tokens per
+ * second */
+typedef struct {
+	gdouble tokens;
+	gdouble capacity;
+	gdouble rate;
+	gint64 updated;
+} token_bucket;
+
+/* Exponential backoff from base up to max milliseconds, with jitter */
+typedef struct {
+	guint base;
+	guint max;
+	guint attempts;
+} backoff;
+
+void token_bucket_init(token_bucket *bucket, gdouble capacity, gdouble rate);
+gboolean token_bucket_take(token_bucket *bucket, gdouble reserve);
+guint token_bucket_wait(token_bucket *bucket, gdouble reserve);
+void token_bucket_drain(token_bucket *bucket);
+
+guint backoff_next(backoff *policy);
+void backoff_reset(backoff *policy);
+
+#endif // HAVE_RETRY_H
@@ -34,13 +34,18 @@
 
 #include "misc.h"
 #include "audioscrobbler.h"
+#include "journal.h"
+#include "metrics.h"
 #include "preferences.h"
+#include "profile.h"
 #include "queue.h"
 #include "scmpc.h"
+#include "spill.h"
 #include "mpd.h"
+#include "retry.h"
+#include "trace.h"
 
 /* Static function prototypes */
-static gboolean scmpc_check(gpointer data);
 static gint scmpc_is_running(void);
 static gint scmpc_pid_create(void);
 static gint scmpc_pid_remove(void);
@@ -54,34 +59,59 @@ static void close_signal_pipe(void);
 static int signal_pipe[2] = { -1, -1 };
 
 static void daemonise(void);
-static gboolean current_song_eligible_for_submission(void);
 
-static guint signal_source, cache_save_source, check_source, reconnect_source;
+static guint signal_source;
 static GMainLoop *loop;
 
+/* With instance sections in the configuration this process only supervises
+ * them: every instance runs in a worker process of its own, started from
+ * the same executable, and is restarted with a backoff if it dies */
+typedef struct {
+	const gchar *name;
+	GPid pid;
+	gint64 started;
+	guint restart_source;
+	backoff delay;
+} scmpc_worker;
+
+static scmpc_worker *workers;
+static guint workers_running, kill_source;
+static gboolean supervisor_stopping;
+static gchar *executable;
+
+static void scmpc_supervise(void);
+static gboolean scmpc_load_queue(gpointer data);
+
 int main(int argc, char *argv[])
 {
 	pid_t pid;
 	struct sigaction sa;
 
+	metrics.started = g_get_monotonic_time();
 	if (init_preferences(argc, argv) < 0)
 		g_error("Config file parsing failed");
 
+	// workers are started from the same executable
+	if (!(executable = g_file_read_link("/proc/self/exe", NULL)))
+		executable = g_strdup(argv[0]);
+
 	/* Open the log file before forking, so that if there is an error, the
 	 * user will get some idea what is going on */
 	open_log(prefs.log_file);
 
 	g_log_set_default_handler(scmpc_log, NULL);
 
-	/* Check if scmpc is already running */
-	if ((pid = scmpc_is_running()) > 0) {
+	/* Check if scmpc is already running, workers are covered by the pid
+	 * file of their supervisor */
+	if (!prefs.instance && (pid = scmpc_is_running()) > 0) {
 		clear_preferences();
 		g_error("Daemon is already running with PID: %ld", (long)pid);
 	}
 
 	/* Daemonise if wanted */
-	if (prefs.fork)
+	if (prefs.fork && !prefs.instance)
 		daemonise();
+	start_log_writer();
 
 	/* Signal handler */
 	open_signal_pipe();
@@ -91,45 +121,50 @@ int main(int argc, char *argv[])
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
 
+	if (prefs.instances[0] && !prefs.instance) {
+		scmpc_supervise();
+		exit(EXIT_SUCCESS);
+	}
+
+	trace_open();
 	if (as_connection_init() < 0) {
 		scmpc_cleanup();
 		exit(EXIT_FAILURE);
 	}
-	as_authenticate();
-
-	queue_load();
-
-	// submit the loaded queue
-	as_check_submit();
-
-	mpd.connected = mpd_connect();
-	if (!mpd.connected) {
-		mpd_connection_free(mpd.conn);
-		mpd.conn = NULL;
-	}
+	metrics_open();
 
 	mpd.song_pos = g_timer_new();
 
 	// set up main loop events
 	loop = g_main_loop_new(NULL, FALSE);
 
-	// save queue
-	cache_save_source = g_timeout_add_seconds(prefs.cache_interval * 60,
-			queue_save, NULL);
-
-	// reconnect if disconnected
-	reconnect_source = g_timeout_add_seconds(300, mpd_reconnect, NULL);
-
-	// check if song is eligible for submission
-	check_source = g_timeout_add_seconds(prefs.mpd_interval, scmpc_check,
-			NULL);
+	/* Nothing waits for anything else at startup: connecting to MPD and
+	 * logging in to Audioscrobbler are under way while the queue is
+	 * loaded. That happens first thing in the main loop, before any of
+	 * their events are handled, and submissions wait for the login. There
+	 * are no periodic timers: songs are checked for eligibility, MPD is
+	 * reconnected to and the cache is saved by one-shot timers which are
+	 * only armed when there is something to do */
+	mpd_connect();
+	as_authenticate();
+	profile_idle_add(G_PRIORITY_HIGH, scmpc_load_queue, NULL);
 
 	g_main_loop_run(loop);
 
 	scmpc_cleanup();
 }
 
+static gboolean scmpc_load_queue(G_GNUC_UNUSED gpointer data)
+{
+	queue_load();
+
+	// submit the loaded queue
+	as_check_submit();
+	return FALSE;
+}
+
 static gint scmpc_is_running(void)
 {
 	FILE *pid_file = fopen(prefs.pid_file, "r");
@@ -236,7 +271,7 @@ static gboolean open_signal_pipe(void)
 	}
 
 	channel = g_io_channel_unix_new(signal_pipe[0]);
-	signal_source = g_io_add_watch(channel, G_IO_IN, signal_parse,
+	signal_source = profile_io_add_watch(channel, G_IO_IN, signal_parse,
 			NULL);
 	g_io_channel_unref(channel);
 	return TRUE;
@@ -263,6 +298,15 @@ static gboolean signal_parse(GIOChannel *source,
 		close_signal_pipe();
 		open_signal_pipe();
 		return TRUE;
+	} else if (sig == SIGHUP) {
+		// the log file has been rotated, the workers share it
+		g_message("Caught SIGHUP, reopening log file.");
+		reopen_log();
+		for (guint i = 0; workers && prefs.instances[i]; i++) {
+			if (workers[i].pid)
+				kill(workers[i].pid, SIGHUP);
+		}
+		return TRUE;
 	} else {
 		g_message("Caught signal %hhd, exiting.", sig);
 		scmpc_shutdown();
@@ -292,32 +336,161 @@ static void daemonise(void)
 	}
 }
 
+static gboolean scmpc_kill_workers(G_GNUC_UNUSED gpointer data)
+{
+	kill_source = 0;
+	for (guint i = 0; prefs.instances[i]; i++) {
+		if (workers[i].pid) {
+			g_warning("Instance %s didn't exit, killing it.",
+					workers[i].name);
+			kill(workers[i].pid, SIGKILL);
+		}
+	}
+	return FALSE;
+}
+
 void scmpc_shutdown(void)
 {
+	if (workers && workers_running) {
+		// the loop quits once the last worker has exited
+		if (supervisor_stopping)
+			return;
+		supervisor_stopping = TRUE;
+		for (guint i = 0; prefs.instances[i]; i++) {
+			if (workers[i].restart_source)
+				g_source_remove(workers[i].restart_source);
+			workers[i].restart_source = 0;
+			if (workers[i].pid)
+				kill(workers[i].pid, SIGTERM);
+		}
+		kill_source = profile_timeout_add_seconds(10,
+				scmpc_kill_workers, NULL);
+		return;
+	}
 	if (g_main_loop_is_running(loop))
 		g_main_loop_quit(loop);
 }
 
+static gboolean scmpc_start_worker(gpointer data);
+
+static void scmpc_worker_exited(GPid pid, gint status, gpointer data)
+{
+	scmpc_worker *worker = data;
+	guint delay;
+
+	g_spawn_close_pid(pid);
+	worker->pid = 0;
+	workers_running--;
+
+	if (supervisor_stopping) {
+		if (!workers_running)
+			g_main_loop_quit(loop);
+		return;
+	}
+
+	// a worker which ran for a while starts over with a short delay
+	if (g_get_monotonic_time() - worker->started >= 60 * G_USEC_PER_SEC)
+		backoff_reset(&worker->delay);
+	delay = backoff_next(&worker->delay);
+	g_warning("Instance %s exited with status %d, restarting in %u ms.",
+			worker->name, status, delay);
+	worker->restart_source = profile_timeout_add(delay, scmpc_start_worker,
+			worker);
+}
+
+static gboolean scmpc_start_worker(gpointer data)
+{
+	scmpc_worker *worker = data;
+	GPtrArray *args = g_ptr_array_new();
+	GError *error = NULL;
+
+	worker->restart_source = 0;
+
+	g_ptr_array_add(args, executable);
+	g_ptr_array_add(args, "--instance");
+	g_ptr_array_add(args, (gchar *)worker->name);
+	if (prefs.config_file) {
+		g_ptr_array_add(args, "--config-file");
+		g_ptr_array_add(args, prefs.config_file);
+	}
+	if (!prefs.fork)
+		g_ptr_array_add(args, "--foreground");
+	if (prefs.log_level == G_LOG_LEVEL_DEBUG)
+		g_ptr_array_add(args, "--debug");
+	g_ptr_array_add(args, NULL);
+
+	if (!g_spawn_async(NULL, (gchar **)args->pdata, NULL,
+				G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+				&worker->pid, &error)) {
+		guint delay = backoff_next(&worker->delay);
+		g_warning("Failed to start instance %s: %s, retrying in %u "
+				"ms.", worker->name, error->message, delay);
+		g_error_free(error);
+		worker->restart_source = profile_timeout_add(delay,
+				scmpc_start_worker, worker);
+	} else {
+		g_message("Started instance %s (PID %ld).", worker->name,
+				(long)worker->pid);
+		worker->started = g_get_monotonic_time();
+		workers_running++;
+		g_child_watch_add(worker->pid, scmpc_worker_exited, worker);
+	}
+	g_ptr_array_free(args, TRUE);
+	return FALSE;
+}
+
+static void scmpc_supervise(void)
+{
+	guint count = g_strv_length(prefs.instances);
+
+	workers = g_new0(scmpc_worker, count);
+	for (guint i = 0; i < count; i++) {
+		workers[i].name = prefs.instances[i];
+		workers[i].delay.base = 1000;
+		workers[i].delay.max = 300000;
+		scmpc_start_worker(&workers[i]);
+	}
+
+	loop = g_main_loop_new(NULL, FALSE);
+	if (workers_running)
+		g_main_loop_run(loop);
+	g_main_loop_unref(loop);
+
+	if (kill_source)
+		g_source_remove(kill_source);
+	g_source_remove(signal_source);
+	close_signal_pipe();
+	if (prefs.fork)
+		scmpc_pid_remove();
+	g_free(workers);
+	g_free(executable);
+	clear_preferences();
+	profile_cleanup();
+	close_log();
+}
+
 static void scmpc_cleanup(void)
 {
 	g_source_remove(signal_source);
-	g_source_remove(mpd.source);
-	g_source_remove(cache_save_source);
-	g_source_remove(check_source);
-	g_source_remove(reconnect_source);
+	mpd_cleanup();
 
-	if (current_song_eligible_for_submission())
+	if (mpd_song_eligible())
 		queue_add_current_song();
-	if (prefs.fork)
+	if (prefs.fork && !prefs.instance)
 		scmpc_pid_remove();
 	close_signal_pipe();
+	metrics_close();
+	trace_close();
 	queue_save(NULL);
+	journal_close();
+	spill_close();
 	if (mpd.song_pos)
 		g_timer_destroy(mpd.song_pos);
+	g_free(executable);
 	clear_preferences();
 	as_cleanup();
-	if (mpd.conn != NULL)
-		mpd_connection_free(mpd.conn);
+	profile_cleanup();
+	close_log();
 }
 
 void kill_scmpc(void)
@@ -336,21 +509,3 @@ void kill_scmpc(void)
 
 	exit(EXIT_SUCCESS);
 }
-
-static gboolean current_song_eligible_for_submission(void)
-{
-	if (!mpd.song)
-		return FALSE;
-
-	return (!mpd.song_submitted &&
-			(g_timer_elapsed(mpd.song_pos, NULL) >= 240 ||
-			 g_timer_elapsed(mpd.song_pos, NULL) >=
-				mpd_song_get_duration(mpd.song) / 2));
-}
-
-static gboolean scmpc_check(G_GNUC_UNUSED gpointer data)
-{
-	if (current_song_eligible_for_submission())
-		queue_add_current_song();
-	return TRUE;
-}
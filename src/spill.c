@@ -0,0 +1,236 @@
+/**
+ * spill.c: On-disk overflow for the song queue.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spill.h"
+#include "misc.h"
+#include "preferences.h"
+
+/* Songs which don't fit into the in-memory queue are appended to the spill
+ * file and read back in order once there is room again. The file is only a
+ * paging area, the songs in it are kept safe by the journal and the cache,
+ * so it is recreated on every start.
+ *
+ * Every record is its size followed by the date, the length and the four
+ * strings of a song, each string prefixed with its length. */
+#define SPILL_NULL G_MAXUINT32
+
+static void spill_rewind(void);
+
+static void spill_put_string(GString *record, const gchar *str)
+{
+	guint32 len = str ? strlen(str) : SPILL_NULL;
+
+	g_string_append_len(record, (gchar *)&len, sizeof len);
+	if (str)
+		g_string_append_len(record, str, len);
+}
+
+static const gchar *spill_get_string(gchar **data, gchar *end)
+{
+	guint32 len;
+	gchar *str;
+
+	if (end - *data < (gssize)sizeof len)
+		return NULL;
+	memcpy(&len, *data, sizeof len);
+	if (len == SPILL_NULL) {
+		*data += sizeof len;
+		return NULL;
+	}
+	if (end - *data - (gssize)sizeof len < (gssize)len)
+		return NULL;
+
+	/* Move the string down over its length so it can be terminated in
+	 * place */
+	str = *data;
+	memmove(str, str + sizeof len, len);
+	str[len] = '\0';
+	*data += sizeof len + len;
+	return str;
+}
+
+static gboolean spill_read(off_t pos, spill_func func, gpointer data,
+		off_t *next)
+{
+	guint32 size;
+	gchar *record, *p, *end;
+	const gchar *artist, *title, *album, *track;
+	gint64 date;
+	guint32 length;
+
+	if (pread(spill.fd, &size, sizeof size, pos) != sizeof size ||
+			size < sizeof date + sizeof length)
+		return FALSE;
+
+	record = g_malloc(size);
+	if (pread(spill.fd, record, size, pos + sizeof size) != (gssize)size) {
+		g_free(record);
+		return FALSE;
+	}
+
+	p = record;
+	end = record + size;
+	memcpy(&date, p, sizeof date);
+	p += sizeof date;
+	memcpy(&length, p, sizeof length);
+	p += sizeof length;
+	artist = spill_get_string(&p, end);
+	title = spill_get_string(&p, end);
+	album = spill_get_string(&p, end);
+	track = spill_get_string(&p, end);
+
+	func(artist, title, album, length, track, date, data);
+	g_free(record);
+
+	*next = pos + sizeof size + size;
+	return TRUE;
+}
+
+gboolean spill_open(void)
+{
+	g_free(spill.path);
+	spill.path = g_strconcat(prefs.cache_file, ".spill", NULL);
+	spill.read_pos = spill.write_pos = 0;
+	spill.count = 0;
+
+	spill.fd = open(spill.path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (spill.fd < 0) {
+		g_warning("Failed to open spill file: %s", g_strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void spill_close(void)
+{
+	if (spill.path && spill.fd >= 0) {
+		close(spill.fd);
+		unlink(spill.path);
+	}
+	spill.fd = -1;
+	g_free(spill.path);
+	spill.path = NULL;
+}
+
+gboolean spill_push(const gchar *artist, const gchar *title,
+		const gchar *album, guint length, const gchar *track,
+		glong date)
+{
+	GString *record;
+	gint64 date64 = date;
+	guint32 length32 = length, size;
+	gssize ret;
+
+	if (!spill.path || spill.fd < 0)
+		return FALSE;
+
+	record = g_string_sized_new(128);
+	g_string_set_size(record, sizeof size);
+	g_string_append_len(record, (gchar *)&date64, sizeof date64);
+	g_string_append_len(record, (gchar *)&length32, sizeof length32);
+	spill_put_string(record, artist);
+	spill_put_string(record, title);
+	spill_put_string(record, album);
+	spill_put_string(record, track);
+	size = record->len - sizeof size;
+	memcpy(record->str, &size, sizeof size);
+
+	ret = pwrite(spill.fd, record->str, record->len, spill.write_pos);
+	if (ret != (gssize)record->len) {
+		g_warning("Failed to write to spill file: %s",
+				ret < 0 ? g_strerror(errno) : "short write");
+		g_string_free(record, TRUE);
+		return FALSE;
+	}
+	spill.write_pos += record->len;
+	spill.count++;
+	g_string_free(record, TRUE);
+	return TRUE;
+}
+
+gboolean spill_pop(spill_func func, gpointer data)
+{
+	if (!spill.count)
+		return FALSE;
+
+	if (!spill_read(spill.read_pos, func, data, &spill.read_pos)) {
+		g_warning("Failed to read from spill file: %s",
+				g_strerror(errno));
+		return FALSE;
+	}
+
+	spill.count--;
+	spill_rewind();
+	return TRUE;
+}
+
+/* Start over at the beginning once everything has been read back, unless
+ * the records are still being read by the cache writer */
+static void spill_rewind(void)
+{
+	if (spill.count || spill.pinned)
+		return;
+	spill.read_pos = spill.write_pos = 0;
+	if (ftruncate(spill.fd, 0) < 0)
+		g_debug("Failed to truncate spill file: %s",
+				g_strerror(errno));
+}
+
+void spill_pin(void)
+{
+	spill.pinned++;
+}
+
+void spill_unpin(void)
+{
+	spill.pinned--;
+	spill_rewind();
+}
+
+/* Only uses pread() on the descriptor, so it can run in another thread as
+ * long as the file is pinned */
+gboolean spill_foreach_from(off_t pos, guint count, spill_func func,
+		gpointer data)
+{
+	for (guint i = 0; i < count; i++) {
+		if (!spill_read(pos, func, data, &pos)) {
+			g_warning("Failed to read from spill file: %s",
+					g_strerror(errno));
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+void spill_foreach(spill_func func, gpointer data)
+{
+	spill_foreach_from(spill.read_pos, spill.count, func, data);
+}
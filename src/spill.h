@@ -0,0 +1,58 @@
+/**
+ * spill.h: On-disk overflow for the song queue.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+#ifndef HAVE_SPILL_H
+#define HAVE_SPILL_H
+
+#include <sys/types.h>
+#include <glib.h>
+
+typedef void (*spill_func)(const gchar *artist, const gchar *title,
+		const gchar *album, guint length, const gchar *track,
+		glong date, gpointer data);
+
+struct {
+	gint fd;
+	gchar *path;
+	off_t read_pos;
+	off_t write_pos;
+	guint count;
+	guint pinned;
+} spill;
+
+gboolean spill_open(void);
+void spill_close(void);
+gboolean spill_push(const gchar *artist, const gchar *title,
+		const gchar *album, guint length, const gchar *track,
+		glong date);
+gboolean spill_pop(spill_func func, gpointer data);
+void spill_pin(void);
+void spill_unpin(void);
+gboolean spill_foreach_from(off_t pos, guint count, spill_func func,
+		gpointer data);
+void spill_foreach(spill_func func, gpointer data);
+
+#endif // HAVE_SPILL_H
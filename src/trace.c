@@ -0,0 +1,174 @@
+/**
+ * trace.c: Trace events in the Chrome trace format.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "preferences.h"
+
+/* The trace file is written in the JSON array format of the Chrome trace
+ * viewer, which Perfetto reads as well. It may lack the closing bracket if
+ * scmpc didn't exit cleanly, both of them cope with that. Timestamps are
+ * taken from the monotonic clock, in microseconds. */
+static FILE *trace_file;
+static gboolean trace_first;
+static glong trace_pid;
+static guint trace_scrobbles;
+
+static void trace_put_string(const gchar *str)
+{
+	putc('"', trace_file);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(trace_file, "\\%c", *str);
+		else if ((guchar)*str < 0x20)
+			fprintf(trace_file, "\\u%04x", (guchar)*str);
+		else
+			putc(*str, trace_file);
+	}
+	putc('"', trace_file);
+}
+
+static void trace_begin(const gchar *category, const gchar *name,
+		gchar phase, gint64 ts)
+{
+	fputs(trace_first ? "\n" : ",\n", trace_file);
+	trace_first = FALSE;
+	fputs("{\"name\":", trace_file);
+	trace_put_string(name);
+	fputs(",\"cat\":", trace_file);
+	trace_put_string(category);
+	fprintf(trace_file, ",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT
+			",\"pid\":%ld,\"tid\":%ld", phase, ts, trace_pid,
+			trace_pid);
+}
+
+static void trace_end(va_list args)
+{
+	const gchar *key, *value;
+	gboolean first = TRUE;
+
+	fputs(",\"args\":{", trace_file);
+	while ((key = va_arg(args, const gchar *))) {
+		value = va_arg(args, const gchar *);
+		if (!first)
+			putc(',', trace_file);
+		first = FALSE;
+		trace_put_string(key);
+		putc(':', trace_file);
+		trace_put_string(value ? value : "");
+	}
+	fputs("}}", trace_file);
+}
+
+void trace_span(const gchar *category, const gchar *name, gint64 start, ...)
+{
+	va_list args;
+
+	if (!trace_file)
+		return;
+
+	trace_begin(category, name, 'X', start);
+	fprintf(trace_file, ",\"dur\":%" G_GINT64_FORMAT,
+			g_get_monotonic_time() - start);
+	va_start(args, start);
+	trace_end(args);
+	va_end(args);
+}
+
+void trace_phase(const gchar *category, const gchar *name, gint64 start,
+		gint64 begin, gint64 duration, ...)
+{
+	va_list args;
+
+	if (!trace_file)
+		return;
+
+	trace_begin(category, name, 'X', start + begin);
+	fprintf(trace_file, ",\"dur\":%" G_GINT64_FORMAT, duration);
+	va_start(args, duration);
+	trace_end(args);
+	va_end(args);
+}
+
+guint trace_scrobble_begin(const gchar *name, ...)
+{
+	va_list args;
+
+	if (!trace_file)
+		return 0;
+
+	trace_begin("scrobble", name, 'b', g_get_monotonic_time());
+	fprintf(trace_file, ",\"id\":\"%x\"", ++trace_scrobbles);
+	va_start(args, name);
+	trace_end(args);
+	va_end(args);
+	return trace_scrobbles;
+}
+
+void trace_scrobble(gchar phase, const gchar *name, guint id, ...)
+{
+	va_list args;
+
+	if (!trace_file || !id)
+		return;
+
+	trace_begin("scrobble", name, phase, g_get_monotonic_time());
+	fprintf(trace_file, ",\"id\":\"%x\"", id);
+	va_start(args, id);
+	trace_end(args);
+	va_end(args);
+}
+
+gboolean trace_open(void)
+{
+	if (!prefs.trace_file || !*prefs.trace_file)
+		return TRUE;
+
+	trace_file = fopen(prefs.trace_file, "w");
+	if (!trace_file) {
+		g_warning("Failed to open trace file %s: %s",
+				prefs.trace_file, g_strerror(errno));
+		return FALSE;
+	}
+	trace_first = TRUE;
+	trace_pid = getpid();
+	fputc('[', trace_file);
+	return TRUE;
+}
+
+void trace_close(void)
+{
+	if (!trace_file)
+		return;
+	fputs("\n]\n", trace_file);
+	fclose(trace_file);
+	trace_file = NULL;
+}
@@ -0,0 +1,54 @@
+/**
+ * trace.h: Trace events in the Chrome trace format.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2011 Christoph Mende <angelos@unkreativ.org>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+
+
+#ifndef HAVE_TRACE_H
+#define HAVE_TRACE_H
+
+#include <glib.h>
+
+/* Every event takes a NULL terminated list of argument names and string
+ * values after the fixed parameters */
+
+/* A span from start, a g_get_monotonic_time() timestamp, until now */
+void trace_span(const gchar *category, const gchar *name, gint64 start,
+		...) G_GNUC_NULL_TERMINATED;
+/* A span at an offset of begin microseconds from start, lasting duration
+ * microseconds, for phases which have been measured elsewhere */
+void trace_phase(const gchar *category, const gchar *name, gint64 start,
+		gint64 begin, gint64 duration, ...) G_GNUC_NULL_TERMINATED;
+/* The life of the scrobble of a song: it begins when the song starts
+ * playing, which returns the id of the scrobble, followed by 'n' for the
+ * steps in between and 'e' at the end. Steps for id 0, a song which didn't
+ * begin in this trace, are left out. */
+guint trace_scrobble_begin(const gchar *name, ...) G_GNUC_NULL_TERMINATED;
+void trace_scrobble(gchar phase, const gchar *name, guint id, ...)
+	G_GNUC_NULL_TERMINATED;
+
+gboolean trace_open(void);
+void trace_close(void);
+
+#endif // HAVE_TRACE_H